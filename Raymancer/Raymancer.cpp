@@ -6,138 +6,4511 @@
 #include <fstream>
 #include <vector>
 #include <cstdint>
+#include <cstddef>
+#include <cstdlib>
+#include <new>
 #include <cassert>
+#include <cstring>
+#include <cerrno>
 #include <sstream>
 #include <iomanip>
 #include <cmath>
+#include <string>
+#include <chrono>
+#include <random>
+#include <memory>
+#include <algorithm>
+#include <bitset>
+#include <unordered_map>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <io.h>
+#include <fcntl.h>
+#include <share.h>
+#include <process.h>
+#include <sys/stat.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define RAYMANCER_IO_URING
+#endif
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define RAYMANCER_SSE2
+#endif
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define RAYMANCER_AVX2
+#endif
+
+#if defined(__SSSE3__) || defined(__AVX2__)
+#include <tmmintrin.h>
+#define RAYMANCER_SSSE3
+#endif
 
 #define STB_IMAGE_IMPLEMENTATION
 #include"stb_image.h"
 
+//generated by the embed mode, see write_embedded_assets
+#ifdef RAYMANCER_EMBEDDED_ASSETS
+#include "embedded_assets.h"
+#endif
+
+#ifdef RAYMANCER_COUNT_ALLOCATIONS
+//---------------------ALLOCATION COUNTER---------------------
+
+/*
+    Every heap allocation goes through the replaced global operator new below and is counted for the thread making it,
+    so a loop can check it allocates nothing per iteration without the encoder and writer threads disturbing its count
+*/
+thread_local size_t thread_allocations = 0;
+
+/*
+    Heap allocations made by the calling thread so far
+*/
+size_t heap_allocations() {
+    return thread_allocations;
+}
+
+//the allocation and release behind the replaced operators stay out of line, so compilers that inline the operators
+//do not see malloc paired with a delete expression and warn about mismatched functions
+#if defined(_MSC_VER)
+#define RAYMANCER_NOINLINE __declspec(noinline)
+#else
+#define RAYMANCER_NOINLINE __attribute__((noinline))
+#endif
+
+RAYMANCER_NOINLINE void* counted_allocate(const size_t size, const size_t alignment) {
+    thread_allocations++;
+    void* p = nullptr;
+#ifdef _WIN32
+    p = _aligned_malloc(size > 0 ? size : 1, alignment);
+#else
+    if (alignment <= alignof(std::max_align_t)) p = std::malloc(size > 0 ? size : 1);
+    else if (posix_memalign(&p, alignment, size > 0 ? size : 1) != 0) p = nullptr;
+#endif
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
+RAYMANCER_NOINLINE void counted_release(void* p) noexcept {
+#ifdef _WIN32
+    _aligned_free(p);
+#else
+    std::free(p);
+#endif
+}
+
+void* operator new(size_t size) {
+    return counted_allocate(size, alignof(std::max_align_t));
+}
+
+void* operator new[](size_t size) {
+    return counted_allocate(size, alignof(std::max_align_t));
+}
+
+void operator delete(void* p) noexcept {
+    counted_release(p);
+}
+
+void operator delete[](void* p) noexcept {
+    counted_release(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    counted_release(p);
+}
+
+void operator delete[](void* p, size_t) noexcept {
+    counted_release(p);
+}
+
+#ifdef __cpp_aligned_new
+//over-aligned types allocate through these, and are counted the same
+void* operator new(size_t size, std::align_val_t alignment) {
+    return counted_allocate(size, size_t(alignment));
+}
+
+void* operator new[](size_t size, std::align_val_t alignment) {
+    return counted_allocate(size, size_t(alignment));
+}
+
+void operator delete(void* p, std::align_val_t) noexcept {
+    counted_release(p);
+}
+
+void operator delete[](void* p, std::align_val_t) noexcept {
+    counted_release(p);
+}
+
+void operator delete(void* p, size_t, std::align_val_t) noexcept {
+    counted_release(p);
+}
+
+void operator delete[](void* p, size_t, std::align_val_t) noexcept {
+    counted_release(p);
+}
+#endif
+#endif
+
+/*
+    Allocates 64-byte aligned memory, so vector loads and stores never split a cache line
+    Throws std::bad_alloc on failure. Freed with aligned_release.
+*/
+void* aligned_allocate(const size_t bytes) {
+    void* p = nullptr;
+#ifdef _WIN32
+    p = _aligned_malloc(bytes > 0 ? bytes : 1, 64);
+#else
+    if (posix_memalign(&p, 64, bytes > 0 ? bytes : 1) != 0) p = nullptr;
+#endif
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
+void aligned_release(void* p) {
+#ifdef _WIN32
+    _aligned_free(p);
+#else
+    free(p);
+#endif
+}
+
+struct AlignedRelease {
+    void operator()(void* p) const {
+        aligned_release(p);
+    }
+};
+
+/*
+    Set of square wall textures packed horizontally in one image
+    Every array is a view into one block, owned by the atlas or a mapped texture cache file, laid out by layout():
+    pixels, each mip level, the colormaps, the palette and each indexed mip level, each section 64-byte aligned.
+    size: texture width or height (square, so same)
+    count: number of textures in the atlas
+    pixels: row-major atlas as loaded, pixels[x + y * size * count]
+    mips: mip chain of every texture, halving in size (rounding down) to 1x1. Level 0 is full resolution.
+        Each level stores every texture column contiguously, mips[level][(texid * level_size + texcoord) * level_size + y],
+        so drawing a wall column reads sequential memory instead of striding a whole atlas row per texel
+    palette: up to 256 colors the textures are quantized to for the shaded path, palette_size of them used,
+        none until build_palette is called
+    indexed_mips: mips as palette indices, same layout as mips at a quarter of the bytes
+    colormaps: LIGHT_LEVELS tables of 256 colors, the palette darkened from full brightness at level 0
+    owner: keeps the block alive when the atlas does not own it, such as a mapped texture cache file
+*/
+struct TextureAtlas {
+    static const size_t LIGHT_LEVELS = 32;
+
+    /*
+        Byte offsets of every array in the block, and the block size
+    */
+    struct Layout {
+        size_t pixels = 0;
+        std::vector<size_t> mips;
+        size_t colormaps = 0;
+        size_t palette = 0;
+        std::vector<size_t> indexed_mips;
+        size_t bytes = 0;
+    };
+
+    size_t size = 0;
+    size_t count = 0;
+    const uint32_t* pixels = nullptr;
+    std::vector<const uint32_t*> mips;
+    const uint32_t* palette = nullptr;
+    size_t palette_size = 0;
+    std::vector<const uint8_t*> indexed_mips;
+    const uint32_t* colormaps = nullptr;
+    std::shared_ptr<const void> owner;
+
+    TextureAtlas() = default;
+    TextureAtlas(TextureAtlas&&) = default;
+    TextureAtlas& operator=(TextureAtlas&&) = default;
+    //the views point into the block, so a copy would point into the original's
+    TextureAtlas(const TextureAtlas&) = delete;
+    TextureAtlas& operator=(const TextureAtlas&) = delete;
+
+    /*
+        Layout of the block for count textures of size x size texels
+    */
+    static Layout layout(const size_t size, const size_t count) {
+        Layout l;
+        auto place = [&l](const size_t bytes) {
+            const size_t offset = l.bytes;
+            l.bytes += (bytes + 63) / 64 * 64;
+            return offset;
+        };
+        l.pixels = place(size * size * count * sizeof(uint32_t));
+        for (size_t level_size = size; level_size > 0; level_size /= 2) l.mips.push_back(place(level_size * level_size * count * sizeof(uint32_t)));
+        l.colormaps = place(LIGHT_LEVELS * 256 * sizeof(uint32_t));
+        l.palette = place(256 * sizeof(uint32_t));
+        for (size_t level_size = size; level_size > 0; level_size /= 2) l.indexed_mips.push_back(place(level_size * level_size * count));
+        return l;
+    }
+
+    /*
+        Allocates a zeroed block owned by the atlas for count textures of size x size texels
+        Returns the pixels to fill in before building the mips and palette.
+    */
+    uint32_t* allocate(const size_t texture_size, const size_t texture_count) {
+        size = texture_size;
+        count = texture_count;
+        palette_size = 0;
+        owner.reset();
+        const size_t bytes = layout(size, count).bytes;
+        storage.reset(static_cast<uint8_t*>(aligned_allocate(bytes)));
+        std::memset(storage.get(), 0, bytes);
+        attach(storage.get());
+        return writable(pixels);
+    }
+
+    /*
+        Points the atlas at a block built elsewhere, laid out for texture_size and texture_count and kept alive by block_owner
+        colors: palette_size of the block
+    */
+    void view(const uint8_t* block, const size_t texture_size, const size_t texture_count, const size_t colors, std::shared_ptr<const void> block_owner) {
+        size = texture_size;
+        count = texture_count;
+        palette_size = colors;
+        storage.reset();
+        owner = std::move(block_owner);
+        attach(block);
+    }
+
+    /*
+        The block the views point into, layout(size, count).bytes long
+    */
+    const uint8_t* block() const {
+        return reinterpret_cast<const uint8_t*>(pixels);
+    }
+
+    /*
+        Texels in one mip level over all textures
+    */
+    size_t level_texels(const size_t level) const {
+        return (size >> level) * (size >> level) * count;
+    }
+
+    /*
+        Rebuilds the mip chain from pixels, each level a 2x2 box filter of the one above
+        A level above with an odd size has its last row and column folded into the last texels, box filtered 3 wide.
+    */
+    void build_mips() {
+        const size_t atlas_w = size * count;
+        uint32_t* top = writable(mips[0]);
+        for (size_t x = 0; x < atlas_w; x++) {
+            for (size_t y = 0; y < size; y++) {
+                top[x * size + y] = pixels[x + y * atlas_w];
+            }
+        }
+
+        for (size_t level = 1; level < mips.size(); level++) {
+            const size_t level_size = size >> level;
+            const uint32_t* src = mips[level - 1];
+            const size_t src_size = size >> (level - 1);
+            uint32_t* dst = writable(mips[level]);
+            for (size_t t = 0; t < count; t++) {
+                for (size_t x = 0; x < level_size; x++) {
+                    const size_t x_end = x + 1 < level_size ? x * 2 + 2 : src_size;
+                    for (size_t y = 0; y < level_size; y++) {
+                        const size_t y_end = y + 1 < level_size ? y * 2 + 2 : src_size;
+                        const uint32_t texels = uint32_t((x_end - x * 2) * (y_end - y * 2));
+                        uint32_t sums[4] = {};
+                        for (size_t sx = x * 2; sx < x_end; sx++) {
+                            const uint32_t* column = &src[(t * src_size + sx) * src_size];
+                            for (size_t sy = y * 2; sy < y_end; sy++) {
+                                for (int c = 0; c < 4; c++) sums[c] += (column[sy] >> (c * 8)) & 255;
+                            }
+                        }
+                        uint32_t color = 0;
+                        //rounds the average to nearest
+                        for (int c = 0; c < 4; c++) color |= ((sums[c] + texels / 2) / texels) << (c * 8);
+                        dst[(t * level_size + x) * level_size + y] = color;
+                    }
+                }
+            }
+        }
+    }
+
+    /*
+        Quantizes the textures to a palette by median cut, then builds indexed_mips and the light level colormaps
+        Must be called after build_mips. Atlases with at most 256 colors keep them exactly.
+        Each box keeps its widest channel, so a split only measures its two halves, and each distinct texel color
+        is matched against the palette once.
+    */
+    void build_palette() {
+        std::vector<uint32_t> colors(pixels, pixels + level_texels(0));
+        std::sort(colors.begin(), colors.end());
+        colors.erase(std::unique(colors.begin(), colors.end()), colors.end());
+
+        //a box is a range of colors, with the channel spanning the widest range in it
+        struct Box {
+            size_t begin, end;
+            int shift;
+            uint32_t range;
+        };
+        auto measure = [&colors](const size_t begin, const size_t end) {
+            Box box = { begin, end, 0, 0 };
+            uint32_t lo[4] = { 255, 255, 255, 255 }, hi[4] = {};
+            for (size_t i = begin; i < end; i++) {
+                for (int c = 0; c < 4; c++) {
+                    lo[c] = std::min(lo[c], (colors[i] >> (c * 8)) & 255);
+                    hi[c] = std::max(hi[c], (colors[i] >> (c * 8)) & 255);
+                }
+            }
+            for (int c = 0; c < 4; c++) {
+                if (hi[c] > lo[c] && hi[c] - lo[c] > box.range) {
+                    box.range = hi[c] - lo[c];
+                    box.shift = c * 8;
+                }
+            }
+            return box;
+        };
+
+        //split the box with the widest channel at its median until there are enough boxes
+        std::vector<Box> boxes(1, measure(0, colors.size()));
+        while (boxes.size() < 256) {
+            size_t widest = 0;
+            for (size_t b = 1; b < boxes.size(); b++) {
+                if (boxes[b].range > boxes[widest].range) widest = b;
+            }
+            if (boxes[widest].range == 0)break;
+            const Box box = boxes[widest];
+            const size_t middle = box.begin + (box.end - box.begin) / 2;
+            const int shift = box.shift;
+            std::nth_element(colors.begin() + box.begin, colors.begin() + middle, colors.begin() + box.end,
+                [shift](uint32_t a, uint32_t b) { return ((a >> shift) & 255) < ((b >> shift) & 255); });
+            boxes[widest] = measure(box.begin, middle);
+            boxes.push_back(measure(middle, box.end));
+        }
+
+        uint32_t* colors_out = writable(palette);
+        palette_size = boxes.size();
+        for (size_t b = 0; b < boxes.size(); b++) {
+            const size_t n = boxes[b].end - boxes[b].begin;
+            uint32_t color = 0;
+            for (int shift = 0; shift < 32; shift += 8) {
+                uint64_t sum = 0;
+                for (size_t i = boxes[b].begin; i < boxes[b].end; i++) sum += (colors[i] >> shift) & 255;
+                color |= uint32_t((sum + n / 2) / n) << shift;
+            }
+            colors_out[b] = color;
+        }
+
+        //map every mip texel to its nearest palette entry, remembering colors already matched
+        //entries are searched outward from the color's green value, stopping on each side once green alone is too far
+        std::vector<uint8_t> by_green(palette_size);
+        for (size_t p = 0; p < palette_size; p++) by_green[p] = (uint8_t)p;
+        std::sort(by_green.begin(), by_green.end(), [this](uint8_t a, uint8_t b) { return ((palette[a] >> 8) & 255) < ((palette[b] >> 8) & 255); });
+        std::unordered_map<uint32_t, uint8_t> seen;
+        seen.reserve(colors.size() * 2);
+        auto nearest = [&](uint32_t color) {
+            auto it = seen.find(color);
+            if (it != seen.end()) return it->second;
+            const int green = (color >> 8) & 255;
+            uint8_t best = 0;
+            int best_dist = INT32_MAX;
+            //ties go to the lowest palette index, as a plain scan in index order would pick
+            auto consider = [&](const uint8_t p) {
+                int dist = 0;
+                for (int shift = 0; shift < 32; shift += 8) {
+                    int d = int((color >> shift) & 255) - int((palette[p] >> shift) & 255);
+                    dist += d * d;
+                }
+                if (dist < best_dist || (dist == best_dist && p < best)) {
+                    best_dist = dist;
+                    best = p;
+                }
+            };
+            const size_t start = std::lower_bound(by_green.begin(), by_green.end(), green,
+                [this](uint8_t p, int g) { return int((palette[p] >> 8) & 255) < g; }) - by_green.begin();
+            for (size_t k = start; k < palette_size; k++) {
+                const int d = int((palette[by_green[k]] >> 8) & 255) - green;
+                if (d * d > best_dist)break;
+                consider(by_green[k]);
+            }
+            for (size_t k = start; k-- > 0;) {
+                const int d = green - int((palette[by_green[k]] >> 8) & 255);
+                if (d * d > best_dist)break;
+                consider(by_green[k]);
+            }
+            seen.emplace(color, best);
+            return best;
+        };
+        for (size_t level = 0; level < mips.size(); level++) {
+            uint8_t* indexed = writable(indexed_mips[level]);
+            for (size_t i = 0; i < level_texels(level); i++) indexed[i] = nearest(mips[level][i]);
+        }
+
+        uint32_t* maps = writable(colormaps);
+        for (size_t light = 0; light < LIGHT_LEVELS; light++) {
+            const uint32_t brightness = uint32_t(256 * (LIGHT_LEVELS - light) / LIGHT_LEVELS);
+            for (size_t p = 0; p < 256; p++) {
+                if (p >= palette_size) {
+                    maps[light * 256 + p] = 0;
+                    continue;
+                }
+                uint32_t r = (palette[p] & 255) * brightness >> 8;
+                uint32_t g = ((palette[p] >> 8) & 255) * brightness >> 8;
+                uint32_t b = ((palette[p] >> 16) & 255) * brightness >> 8;
+                maps[light * 256 + p] = (palette[p] & 0xff000000) | (b << 16) | (g << 8) | r;
+            }
+        }
+    }
+
+    /*
+        Mip level for a wall column drawn column_height pixels high: the smallest level with at least that many texels
+    */
+    size_t mip_level(const uint64_t column_height) const {
+        size_t level = 0;
+        while (level + 1 < mips.size() && (size >> (level + 1)) >= column_height) level++;
+        return level;
+    }
+
+private:
+    //points every view at its place in a block laid out for size and count
+    void attach(const uint8_t* block) {
+        const Layout l = layout(size, count);
+        pixels = reinterpret_cast<const uint32_t*>(block + l.pixels);
+        mips.clear();
+        for (size_t offset : l.mips) mips.push_back(reinterpret_cast<const uint32_t*>(block + offset));
+        colormaps = reinterpret_cast<const uint32_t*>(block + l.colormaps);
+        palette = reinterpret_cast<const uint32_t*>(block + l.palette);
+        indexed_mips.clear();
+        for (size_t offset : l.indexed_mips) indexed_mips.push_back(block + offset);
+    }
+
+    //a view into the owned block, for the build steps to fill in
+    template <typename T>
+    T* writable(const T* view) {
+        assert(!owner && storage);
+        return const_cast<T*>(view);
+    }
+
+    std::unique_ptr<uint8_t, AlignedRelease> storage;//the block when the atlas owns it, 64-byte aligned as layout assumes
+};
+
+/*
+    Colors drawn above and below the walls, and how column pixels are stored
+    stream: store with non-temporal stores, which go around the cache instead of evicting what the renderer still reads.
+    Worth it when the frame is not read again before its lines would have left the cache anyway;
+    call stream_fence() before another thread reads the pixels.
+*/
+struct ColumnFill {
+    uint32_t ceiling;
+    uint32_t floor;
+    bool stream;
+};
+
+/*
+    Orders the calling thread's non-temporal stores before its later stores, so a frame drawn with ColumnFill::stream
+    can be handed to another thread
+*/
+inline void stream_fence() {
+#ifdef RAYMANCER_SSE2
+    _mm_sfence();
+#endif
+}
+
+template <bool Stream>
+inline void store_pixel(uint32_t* pixel, const uint32_t color) {
+#ifdef RAYMANCER_SSE2
+    if (Stream) {
+        _mm_stream_si32((int*)pixel, (int)color);
+        return;
+    }
+#endif
+    *pixel = color;
+}
+
+template <bool Stream>
+inline void fill_span(uint32_t* pixel, size_t count, const uint32_t color) {
+#ifdef RAYMANCER_SSE2
+    if (Stream) {
+        //single pixels up to a 16-byte boundary, then whole vectors
+        for (; count > 0 && ((uintptr_t)pixel & 15) != 0; count--) store_pixel<true>(pixel++, color);
+        const __m128i colors = _mm_set1_epi32((int)color);
+        for (; count >= 4; count -= 4, pixel += 4) _mm_stream_si128((__m128i*)pixel, colors);
+        for (; count > 0; count--) store_pixel<true>(pixel++, color);
+        return;
+    }
+#endif
+    std::fill_n(pixel, count, color);
+}
+
+template <bool Stream>
+void draw_column_spans(uint32_t* pixel, const size_t img_h, const TextureAtlas& atlas, const size_t texid, const size_t texcoord, const uint64_t column_height, const size_t level, const uint32_t* colormap, const ColumnFill& fill) {
+    //rows of the wall that are on screen, none for a column without a wall
+    const int64_t top = (int64_t)(img_h / 2) - (int64_t)(column_height / 2);
+    const int64_t first = std::max<int64_t>(0, -top);
+    const int64_t last = std::min<int64_t>((int64_t)column_height, (int64_t)img_h - top);
+
+    fill_span<Stream>(pixel, top + first, fill.ceiling);
+    pixel += top + first;
+    if (column_height > 0) {
+        const size_t texsize = atlas.size >> level;
+        //rounding the step up makes row j land on texel j * texsize / column_height exactly for columns up to 65536 high
+        const uint64_t tex_step = (((uint64_t)texsize << 32) + column_height - 1) / column_height;
+        uint64_t tex_pos = first * tex_step;
+        //scaled rather than shifted, as a level of a texture whose size is not a power of two is not exactly halved
+        const size_t column = (texid * texsize + texcoord * texsize / atlas.size) * texsize;
+        if (colormap) {
+            const uint8_t* texel = atlas.indexed_mips[level] + column;
+            for (int64_t j = first; j < last; j++) {
+                store_pixel<Stream>(pixel++, colormap[texel[tex_pos >> 32]]);
+                tex_pos += tex_step;
+            }
+        } else {
+            const uint32_t* texel = atlas.mips[level] + column;
+            for (int64_t j = first; j < last; j++) {
+                store_pixel<Stream>(pixel++, texel[tex_pos >> 32]);
+                tex_pos += tex_step;
+            }
+        }
+    }
+    fill_span<Stream>(pixel, img_h - (top + last), fill.floor);
+}
+
+/*
+    Draws the whole of image column x in one pass: the ceiling, a column of the desired texture stretched to column_height
+    and centered vertically, then the floor, so frames need no clearing beforehand
+    The texture is stepped through in 32.32 fixed point, and only rows that land on the image are visited,
+    so a very close wall costs no more than one that exactly fills the screen.
+    img: column-major image drawn into, img[x * img_h + y], so the column is one contiguous run of pixels
+    x: image column to draw
+    atlas: texture atlas, read through its column-major mips
+    texid: which texture to be used
+    texcoord: which column of texture to be used, at full resolution
+    column_height: height of wall pixels to be drawn, 0 for a column that hit no wall and is only ceiling and floor
+    level: mip level to sample
+    colormap: if set, one of the atlas light level tables, and the column is drawn from the indexed mips through it
+    fill: ceiling and floor colors, and whether to stream the stores
+*/
+void draw_column(uint32_t* img, const size_t img_w, const size_t img_h, const size_t x, const TextureAtlas& atlas, const size_t texid, const size_t texcoord, const uint64_t column_height, const size_t level, const uint32_t* colormap, const ColumnFill& fill) {
+    assert(level < atlas.mips.size() && texcoord < atlas.size && texid < atlas.count && x < img_w);
+    uint32_t* column = img + x * img_h;
+    if (fill.stream) draw_column_spans<true>(column, img_h, atlas, texid, texcoord, column_height, level, colormap, fill);
+    else draw_column_spans<false>(column, img_h, atlas, texid, texcoord, column_height, level, colormap, fill);
+}
+
+/*
+    Draws a rectangle on the passed vector representing an image
+*/
+void draw_rectangle(std::vector<uint32_t> &img, const size_t img_w, const size_t img_h, const size_t x, const size_t y, const size_t w, const size_t h, const uint32_t color){
+    assert(img.size() == img_w * img_h);
+    for (int i = 0; i < w; i++) {
+        for (int j = 0; j < h; j++) {
+            size_t cx = x + i;
+            size_t cy = y + j;
+            if (cx >= img_w || cy >= img_h)continue;
+            img[cx + cy * img_w] = color;
+        }
+    }
+}
+
+/*
+    packs four 8-bit color traits into a single 32-bit color
+*/
+uint32_t pack_color(const uint8_t r, const uint8_t g, const uint8_t b, const uint8_t a = 255){
+    return ((a<<24)+(b<<16)+(g<<8)+(r));
+}
+
+/*
+    Load texture atlas from image file using the public stbi library, along with its column-major mips
+    palettize: also build the palette, indexed mips and colormaps, which only the shaded path reads
+*/
+bool load_texture(const std::string filename, TextureAtlas& atlas, const bool palettize = false) {
+    int nchannels = -1, w, h;
+
+    unsigned char* pixmap = stbi_load(filename.c_str(), &w, &h, &nchannels, 0);
+    if (!pixmap) {
+        std::cerr << "Unable to load texture: " << filename << std::endl;
+        return false;
+    }
+
+    if (nchannels != 4) {
+        std::cerr << "Error: Texture file " << filename << " must be a 32-bit image." << std::endl;
+        stbi_image_free(pixmap);
+        return false;
+    }
+
+    const size_t count = w / h;
+    if (count == 0 || w != h * (int)count) {
+        std::cerr << "Error: The texture file must be N square textures packed horizontally." << std::endl;
+        stbi_image_free(pixmap);
+        return false;
+    }
+
+    uint32_t* pixels = atlas.allocate(h, count);
+    for (int j = 0; j < h; j++) {
+        for (int i = 0; i < w; i++) {
+            uint8_t r = pixmap[(i + j * w) * 4 + 0];
+            uint8_t g = pixmap[(i + j * w) * 4 + 1];
+            uint8_t b = pixmap[(i + j * w) * 4 + 2];
+            uint8_t a = pixmap[(i + j * w) * 4 + 3];
+            pixels[i + j * w] = pack_color(r, g, b, a);
+        }
+    }
+
+    stbi_image_free(pixmap);
+    atlas.build_mips();
+    if (palettize) atlas.build_palette();
+    return true;
+}
+
+/*
+    unpacks 32-bit color representation into 4 8-bit color traits
+*/
+void unpack_color(const uint32_t& color, uint8_t &r, uint8_t &g, uint8_t &b, uint8_t &a) {
+    a = (color >> 24) & 255;
+    b = (color>>16) & 255;
+    g = (color>>8) & 255;
+    r = (color) & 255;
+}
+
+/*
+    Side of a map cell that a ray hit. North is the -y side of the cell, west the -x side.
+*/
+enum HitFace { FACE_NORTH, FACE_SOUTH, FACE_EAST, FACE_WEST };
+
+/*
+    Result of casting a single ray through the map
+    hit: false if the ray left the map or went past max_dist without hitting a wall
+    dist: distance along the (normalized) ray to the wall face
+    map_x, map_y: map cell that was hit
+    cell: map character of the hit cell
+    face: which side of the cell the ray entered through
+    texcoord: exact fractional position along the face, in [0,1)
+*/
+struct RayHit {
+    bool hit;
+    float dist;
+    int map_x, map_y;
+    char cell;
+    HitFace face;
+    float texcoord;
+};
+
+/*
+    Fills in a ray hit once traversal has found the wall cell. Shared by the scalar and packet ray casters.
+    x_side: true if the ray crossed a vertical (x) grid line to enter the cell
+*/
+void finish_hit(RayHit& result, const char* map, const size_t map_w, const float ox, const float oy, const float dx, const float dy, const float dist, const int map_x, const int map_y, const bool x_side) {
+    result.hit = true;
+    result.dist = dist;
+    result.map_x = map_x;
+    result.map_y = map_y;
+    result.cell = map[map_x + map_y * map_w];
+    //position along the wall is the coordinate on the axis the face runs along
+    float wall = x_side ? oy + dist * dy : ox + dist * dx;
+    result.texcoord = wall - std::floor(wall);
+    if (x_side) {
+        result.face = dx < 0.0f ? FACE_EAST : FACE_WEST;
+    } else {
+        result.face = dy < 0.0f ? FACE_SOUTH : FACE_NORTH;
+    }
+}
+
+/*
+    Distance along a ray to its n-th grid line on one axis after the first, as cast_ray computes it
+    n = 0 is kept apart so that an axis-parallel ray's infinite delta never makes 0 * infinity.
+*/
+inline float grid_line(const float first, const float delta, const int n) {
+    return n == 0 ? first : first + n * delta;
+}
+
+/*
+    The DDA loop of cast_ray, resumed along the same ray from the cell and grid line counts it had reached
+    Callers that stop a traversal part way hand it on here and get the result cast_ray would have returned.
+    lines_x, lines_y: x (and y) grid lines crossed so far
+*/
+RayHit resume_ray(const char* map, const size_t map_w, const size_t map_h, const float ox, const float oy, const float dx, const float dy, const float max_dist, int map_x, int map_y, int lines_x, int lines_y) {
+    RayHit result = {};
+    const int origin_x = (int)std::floor(ox);
+    const int origin_y = (int)std::floor(oy);
+
+    //distance along the ray between two x (or y) grid lines. Infinity for rays parallel to that axis.
+    const float delta_x = dx == 0.0f ? INFINITY : std::abs(1.0f / dx);
+    const float delta_y = dy == 0.0f ? INFINITY : std::abs(1.0f / dy);
+    const int step_x = dx < 0.0f ? -1 : 1;
+    const int step_y = dy < 0.0f ? -1 : 1;
+
+    //distance along the ray to the first x (or y) grid line. The n-th line after it is at first_x + n * delta_x,
+    //worked out from the count instead of summed step by step, so casters that skip cells land on the same distances
+    const float first_x = dx < 0.0f ? (ox - origin_x) * delta_x : (origin_x + 1.0f - ox) * delta_x;
+    const float first_y = dy < 0.0f ? (oy - origin_y) * delta_y : (origin_y + 1.0f - oy) * delta_y;
+    float side_x = grid_line(first_x, delta_x, lines_x);
+    float side_y = grid_line(first_y, delta_y, lines_y);
+
+    float dist = 0.0f;
+    bool x_side = false;
+    for (;;) {
+        if (side_x < side_y) {
+            dist = side_x;
+            side_x = first_x + ++lines_x * delta_x;
+            map_x += step_x;
+            x_side = true;
+        } else {
+            dist = side_y;
+            side_y = first_y + ++lines_y * delta_y;
+            map_y += step_y;
+            x_side = false;
+        }
+        if (dist > max_dist || map_x < 0 || map_y < 0 || map_x >= (int)map_w || map_y >= (int)map_h) return result;
+        if (map[map_x + map_y * map_w] != ' ')break;
+    }
+
+    finish_hit(result, map, map_w, ox, oy, dx, dy, dist, map_x, map_y, x_side);
+    return result;
+}
+
+/*
+    Casts a ray through the map grid using a DDA (Amanatides-Woo) traversal, visiting exactly one cell per step
+    map: map characters, ' ' is empty space
+    ox, oy: ray origin in map units
+    dx, dy: normalized ray direction
+    max_dist: distance after which the ray is considered a miss
+*/
+RayHit cast_ray(const char* map, const size_t map_w, const size_t map_h, const float ox, const float oy, const float dx, const float dy, const float max_dist) {
+    return resume_ray(map, map_w, map_h, ox, oy, dx, dy, max_dist, (int)std::floor(ox), (int)std::floor(oy), 0, 0);
+}
+
+/*
+    Map cells widened to 32 bits so that vector gathers can read them directly
+    packets: cast_rays uses the packet caster on this grid, set by choose_ray_caster where packets measure faster
+*/
+struct CellGrid {
+    size_t w, h;
+    std::vector<int32_t> cells;
+    bool packets = false;
+
+    CellGrid(const char* map, const size_t map_w, const size_t map_h) : w(map_w), h(map_h), cells(map_w * map_h) {
+        for (size_t i = 0; i < map_w * map_h; i++) cells[i] = map[i];
+    }
+};
+
+#ifdef RAYMANCER_AVX2
+//lanes of a packet left to finish on the scalar loop instead of in the packet
+const size_t PACKET_SCALAR_LANES = 3;
+
+/*
+    Casts a packet of 8 rays from a shared origin together, one ray per AVX2 lane
+    The traversal performs the same float operations as cast_ray in the same order, and hits are finished
+    with the same scalar code, so results are bit-identical to the scalar path. The last PACKET_SCALAR_LANES
+    rays still going are resumed on the scalar loop rather than stepped with the other lanes masked off.
+    dx, dy: 8 normalized ray directions
+    hits: receives 8 results
+*/
+void cast_ray_packet(const char* map, const CellGrid& grid, const float ox, const float oy, const float* dx, const float* dy, const float max_dist, RayHit* hits) {
+    const __m256 vdx = _mm256_loadu_ps(dx);
+    const __m256 vdy = _mm256_loadu_ps(dy);
+    const __m256 vox = _mm256_set1_ps(ox);
+    const __m256 voy = _mm256_set1_ps(oy);
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 abs_mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+
+    const __m256 floor_x = _mm256_floor_ps(vox);
+    const __m256 floor_y = _mm256_floor_ps(voy);
+    __m256i map_x = _mm256_cvttps_epi32(floor_x);
+    __m256i map_y = _mm256_cvttps_epi32(floor_y);
+
+    //1/0 is infinity, matching the scalar special case for axis-parallel rays
+    const __m256 delta_x = _mm256_and_ps(_mm256_div_ps(one, vdx), abs_mask);
+    const __m256 delta_y = _mm256_and_ps(_mm256_div_ps(one, vdy), abs_mask);
+    const __m256 neg_x = _mm256_cmp_ps(vdx, zero, _CMP_LT_OQ);
+    const __m256 neg_y = _mm256_cmp_ps(vdy, zero, _CMP_LT_OQ);
+    const __m256i step_x = _mm256_blendv_epi8(_mm256_set1_epi32(1), _mm256_set1_epi32(-1), _mm256_castps_si256(neg_x));
+    const __m256i step_y = _mm256_blendv_epi8(_mm256_set1_epi32(1), _mm256_set1_epi32(-1), _mm256_castps_si256(neg_y));
+
+    const __m256 first_x = _mm256_blendv_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_add_ps(floor_x, one), vox), delta_x), _mm256_mul_ps(_mm256_sub_ps(vox, floor_x), delta_x), neg_x);
+    const __m256 first_y = _mm256_blendv_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_add_ps(floor_y, one), voy), delta_y), _mm256_mul_ps(_mm256_sub_ps(voy, floor_y), delta_y), neg_y);
+    __m256 side_x = first_x, side_y = first_y;
+    __m256i lines_x = _mm256_setzero_si256(), lines_y = _mm256_setzero_si256();
+
+    const __m256i map_w = _mm256_set1_epi32((int)grid.w);
+    const __m256i map_h = _mm256_set1_epi32((int)grid.h);
+    const __m256i minus_one = _mm256_set1_epi32(-1);
+    const __m256i empty = _mm256_set1_epi32(' ');
+    const __m256 vmax = _mm256_set1_ps(max_dist);
+
+    __m256i active = minus_one;
+    __m256i hit = _mm256_setzero_si256();
+    __m256i x_side = _mm256_setzero_si256();
+    __m256 dist = zero;
+    //lanes that finish early idle until the last one does, so once few are left they go on one at a time
+    while (std::bitset<8>(_mm256_movemask_ps(_mm256_castsi256_ps(active))).count() > PACKET_SCALAR_LANES) {
+        const __m256i lt = _mm256_castps_si256(_mm256_cmp_ps(side_x, side_y, _CMP_LT_OQ));
+        const __m256i move_x = _mm256_and_si256(lt, active);
+        const __m256i move_y = _mm256_andnot_si256(lt, active);
+
+        dist = _mm256_blendv_ps(dist, side_x, _mm256_castsi256_ps(move_x));
+        dist = _mm256_blendv_ps(dist, side_y, _mm256_castsi256_ps(move_y));
+        //moving lanes count one more grid line, masks being -1
+        lines_x = _mm256_sub_epi32(lines_x, move_x);
+        lines_y = _mm256_sub_epi32(lines_y, move_y);
+        side_x = _mm256_blendv_ps(side_x, _mm256_add_ps(first_x, _mm256_mul_ps(_mm256_cvtepi32_ps(lines_x), delta_x)), _mm256_castsi256_ps(move_x));
+        side_y = _mm256_blendv_ps(side_y, _mm256_add_ps(first_y, _mm256_mul_ps(_mm256_cvtepi32_ps(lines_y), delta_y)), _mm256_castsi256_ps(move_y));
+        map_x = _mm256_add_epi32(map_x, _mm256_and_si256(step_x, move_x));
+        map_y = _mm256_add_epi32(map_y, _mm256_and_si256(step_y, move_y));
+        x_side = _mm256_blendv_epi8(x_side, lt, active);
+
+        //rays that left the map or went too far terminate as misses
+        __m256i inside = _mm256_andnot_si256(_mm256_castps_si256(_mm256_cmp_ps(dist, vmax, _CMP_GT_OQ)), active);
+        inside = _mm256_and_si256(inside, _mm256_cmpgt_epi32(map_x, minus_one));
+        inside = _mm256_and_si256(inside, _mm256_cmpgt_epi32(map_y, minus_one));
+        inside = _mm256_and_si256(inside, _mm256_cmpgt_epi32(map_w, map_x));
+        inside = _mm256_and_si256(inside, _mm256_cmpgt_epi32(map_h, map_y));
+
+        const __m256i index = _mm256_add_epi32(map_x, _mm256_mullo_epi32(map_y, map_w));
+        const __m256i cells = _mm256_mask_i32gather_epi32(empty, (const int*)grid.cells.data(), index, inside, 4);
+        const __m256i wall = _mm256_andnot_si256(_mm256_cmpeq_epi32(cells, empty), inside);
+
+        hit = _mm256_or_si256(hit, wall);
+        active = _mm256_andnot_si256(_mm256_or_si256(wall, _mm256_andnot_si256(inside, active)), active);
+    }
+
+    alignas(32) int32_t lane_active[8], lane_hit[8], lane_x_side[8], lane_map_x[8], lane_map_y[8], lane_lines_x[8], lane_lines_y[8];
+    alignas(32) float lane_dist[8];
+    _mm256_store_si256((__m256i*)lane_active, active);
+    _mm256_store_si256((__m256i*)lane_lines_x, lines_x);
+    _mm256_store_si256((__m256i*)lane_lines_y, lines_y);
+    _mm256_store_si256((__m256i*)lane_hit, hit);
+    _mm256_store_si256((__m256i*)lane_x_side, x_side);
+    _mm256_store_si256((__m256i*)lane_map_x, map_x);
+    _mm256_store_si256((__m256i*)lane_map_y, map_y);
+    _mm256_store_ps(lane_dist, dist);
+    for (int k = 0; k < 8; k++) {
+        if (lane_active[k]) {
+            hits[k] = resume_ray(map, grid.w, grid.h, ox, oy, dx[k], dy[k], max_dist, lane_map_x[k], lane_map_y[k], lane_lines_x[k], lane_lines_y[k]);
+            continue;
+        }
+        hits[k] = RayHit();
+        if (!lane_hit[k])continue;
+        finish_hit(hits[k], map, grid.w, ox, oy, dx[k], dy[k], lane_dist[k], lane_map_x[k], lane_map_y[k], lane_x_side[k] != 0);
+    }
+}
+#endif
+
+/*
+    Casts n rays from a shared origin, using the packet caster for groups of 8 where available and faster
+    dx, dy: n normalized ray directions
+    hits: receives n results
+*/
+void cast_rays(const char* map, const CellGrid& grid, const float ox, const float oy, const float* dx, const float* dy, const size_t n, const float max_dist, RayHit* hits) {
+    size_t i = 0;
+#ifdef RAYMANCER_AVX2
+    if (grid.packets) {
+        for (; i + 8 <= n; i += 8) {
+            cast_ray_packet(map, grid, ox, oy, dx + i, dy + i, max_dist, hits + i);
+        }
+    }
+#endif
+    for (; i < n; i++) {
+        hits[i] = cast_ray(map, grid.w, grid.h, ox, oy, dx[i], dy[i], max_dist);
+    }
+}
+
+/*
+    Fastest rates, in rays per second, of cast_ray and of the packet caster on a fan of rays from (ox, oy)
+    The two take turns for the given number of rounds and each keeps its best round, so a round slowed down by
+    other work on the machine does not decide which one wins. Without AVX2 the packet rate is cast_rays' scalar one.
+    nrays: a multiple of 8
+*/
+struct CasterRates {
+    double scalar, packet;
+};
+
+CasterRates time_ray_casters(const char* map, const CellGrid& grid, const float ox, const float oy, const float max_dist, const size_t nrays, const int rounds) {
+    std::vector<float> dx(nrays), dy(nrays);
+    for (size_t i = 0; i < nrays; i++) {
+        float a = 2 * M_PI * i / nrays;
+        dx[i] = std::cos(a);
+        dy[i] = std::sin(a);
+    }
+    std::vector<RayHit> hits(nrays);
+    CasterRates rates = { 0, 0 };
+    for (int round = 0; round < rounds; round++) {
+        for (int kernel = 0; kernel < 2; kernel++) {
+            auto start = std::chrono::steady_clock::now();
+            if (kernel == 0) {
+                for (size_t i = 0; i < nrays; i++) hits[i] = cast_ray(map, grid.w, grid.h, ox, oy, dx[i], dy[i], max_dist);
+            } else {
+#ifdef RAYMANCER_AVX2
+                for (size_t i = 0; i + 8 <= nrays; i += 8) cast_ray_packet(map, grid, ox, oy, &dx[i], &dy[i], max_dist, &hits[i]);
+#else
+                cast_rays(map, grid, ox, oy, dx.data(), dy.data(), nrays, max_dist, hits.data());
+#endif
+            }
+            const double rate = nrays / std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            double& best = kernel == 0 ? rates.scalar : rates.packet;
+            best = std::max(best, rate);
+        }
+    }
+    return rates;
+}
+
+//rays and rounds choose_ray_caster times each caster for. Near a tie the choice can differ between runs, where
+//either caster is about as fast.
+const size_t CASTER_PROBE_RAYS = 2048;
+const int CASTER_PROBE_ROUNDS = 7;
+
+/*
+    Sets whether cast_rays uses the packet caster on the grid, by timing both casters on rays from (ox, oy)
+    Which one is faster depends on the map's size together with how far rays travel in it: on a large open map the
+    lanes' gathers spread far apart and miss the cache, while on the same map with dense walls packets still win.
+*/
+void choose_ray_caster(CellGrid& grid, const char* map, const float ox, const float oy, const float max_dist) {
+#ifdef RAYMANCER_AVX2
+    const CasterRates rates = time_ray_casters(map, grid, ox, oy, max_dist, CASTER_PROBE_RAYS, CASTER_PROBE_ROUNDS);
+    grid.packets = rates.packet > rates.scalar;
+#else
+    (void)grid;
+    (void)map;
+    (void)ox;
+    (void)oy;
+    (void)max_dist;
+#endif
+}
+
+/*
+    Per-cell distance to the nearest wall, for empty-space skipping in the ray marcher
+    Each cell stores the Chebyshev distance in cells to the nearest wall cell, with everything outside the map
+    counting as wall. From any point in a cell with distance D, no wall is closer than D - 1 plus the distance
+    to the edge of the cell, so a marcher can safely step that far.
+*/
+class DistanceField {
+public:
+    DistanceField(const char* map, const size_t map_w, const size_t map_h) : w(map_w), h(map_h), dist(map_w * map_h), counts(1, map_w * map_h) {
+        rebuild(map, 0, 0, (int)w, (int)h);
+    }
+
+    /*
+        Updates the field after the map cell at (x, y) changed, only revisiting the cells it can affect
+    */
+    void update_cell(const char* map, const int x, const int y) {
+        //cells further from (x, y) than the largest distance already had a nearer wall and keep their value
+        const int r = max_dist + 1;
+        rebuild(map, std::max(0, x - r), std::max(0, y - r), std::min((int)w, x + r + 1), std::min((int)h, y + r + 1));
+    }
+
+    /*
+        Distance in map units from (x, y) within which there is certainly no wall
+    */
+    float safe_distance(const float x, const float y) const {
+        const int cx = (int)x;
+        const int cy = (int)y;
+        const float fx = x - cx;
+        const float fy = y - cy;
+        const float edge = std::min(std::min(fx, 1.0f - fx), std::min(fy, 1.0f - fy));
+        const uint16_t d = dist[cx + cy * w];
+        return d == 0 ? 0.0f : d - 1 + edge;
+    }
+
+    /*
+        Distance in cells from cell (x, y) to the nearest wall cell
+    */
+    int distance(const int x, const int y) const {
+        return dist[x + y * w];
+    }
+
+    bool operator==(const DistanceField& other) const {
+        return w == other.w && h == other.h && dist == other.dist;
+    }
+
+private:
+    int at(const int x, const int y) const {
+        if (x < 0 || y < 0 || x >= (int)w || y >= (int)h) return 0;
+        return dist[x + y * w];
+    }
+
+    /*
+        Recomputes the window [x0, x1) x [y0, y1) with a two-pass chessboard distance transform,
+        using the current values around the window as fixed seeds
+    */
+    void rebuild(const char* map, const int x0, const int y0, const int x1, const int y1) {
+        const uint16_t unbounded = 0xffff;
+        for (int y = y0; y < y1; y++) {
+            for (int x = x0; x < x1; x++) {
+                counts[dist[x + y * w]]--;
+                dist[x + y * w] = map[x + y * w] == ' ' ? unbounded : 0;
+            }
+        }
+        for (int y = y0; y < y1; y++) {
+            for (int x = x0; x < x1; x++) {
+                uint16_t& d = dist[x + y * w];
+                if (d == 0)continue;
+                int best = std::min(std::min(at(x - 1, y - 1), at(x, y - 1)), std::min(at(x + 1, y - 1), at(x - 1, y)));
+                //cells right of and below the window are seeds too
+                if (x == x1 - 1) best = std::min(best, at(x + 1, y));
+                if (y == y1 - 1) best = std::min(std::min(best, at(x - 1, y + 1)), std::min(at(x, y + 1), at(x + 1, y + 1)));
+                d = (uint16_t)std::min<int>(d, best + 1);
+            }
+        }
+        for (int y = y1 - 1; y >= y0; y--) {
+            for (int x = x1 - 1; x >= x0; x--) {
+                uint16_t& d = dist[x + y * w];
+                if (d == 0)continue;
+                int best = std::min(std::min(at(x + 1, y + 1), at(x, y + 1)), std::min(at(x - 1, y + 1), at(x + 1, y)));
+                d = (uint16_t)std::min<int>(d, best + 1);
+            }
+        }
+        //the window's new values go into the counts, and the largest distance is the largest one still counted
+        for (int y = y0; y < y1; y++) {
+            for (int x = x0; x < x1; x++) {
+                const uint16_t d = dist[x + y * w];
+                if (d >= counts.size()) counts.resize(d + 1, 0);
+                counts[d]++;
+                max_dist = std::max<int>(max_dist, d);
+            }
+        }
+        while (max_dist > 0 && counts[max_dist] == 0) max_dist--;
+    }
+
+    size_t w, h;
+    std::vector<uint16_t> dist;
+    std::vector<size_t> counts;//number of cells at each distance, so max_dist follows updates without a rescan
+    int max_dist = 0;
+};
+
+/*
+    Occupancy of the map in 8x8 cell blocks, so ray traversal can skip empty space in one step
+    A block is occupied if any cell inside it is a wall. The blocks' own distance field gives each empty block its
+    clearance, the Chebyshev distance in blocks to the nearest occupied one, so the square of clearance - 1 blocks
+    on every side of it is empty too. Each cell also keeps a kind that folds in whether its block is empty, so a
+    traversal finds both walls and empty blocks with the one read per cell the plain DDA loop makes.
+*/
+enum CellKind : uint8_t { CELL_OPEN, CELL_WALL, CELL_IN_EMPTY_BLOCK };
+
+class OccupancyHierarchy {
+public:
+    static const int BLOCK_SHIFT = 3;
+    static const int BLOCK_CELLS = 1 << BLOCK_SHIFT;
+
+    OccupancyHierarchy(const char* map, const size_t map_w, const size_t map_h) : w(map_w), h(map_h),
+        blocks_w((map_w + BLOCK_CELLS - 1) >> BLOCK_SHIFT), blocks_h((map_h + BLOCK_CELLS - 1) >> BLOCK_SHIFT),
+        blocks(occupied_blocks(map, map_w, map_h)), clearance(blocks.c_str(), blocks_w, blocks_h), kinds(map_w * map_h) {
+        for (size_t y = 0; y < h; y++) {
+            for (size_t x = 0; x < w; x++) {
+                kinds[x + y * w] = kind_of(map, x, y);
+            }
+        }
+    }
+
+    /*
+        Updates the blocks, their clearance and the cell kinds after the map cell at (x, y) changed
+    */
+    void update_cell(const char* map, const int x, const int y) {
+        const int bx = x >> BLOCK_SHIFT;
+        const int by = y >> BLOCK_SHIFT;
+        const int x0 = bx * BLOCK_CELLS, x1 = std::min(x0 + BLOCK_CELLS, (int)w);
+        const int y0 = by * BLOCK_CELLS, y1 = std::min(y0 + BLOCK_CELLS, (int)h);
+        bool any = false;
+        for (int j = y0; j < y1 && !any; j++) {
+            for (int i = x0; i < x1; i++) {
+                if (map[i + j * w] != ' ') {
+                    any = true;
+                    break;
+                }
+            }
+        }
+        char& block = blocks[bx + by * blocks_w];
+        if ((block != ' ') != any) {
+            block = any ? '#' : ' ';
+            clearance.update_cell(blocks.c_str(), bx, by);
+        }
+        //the block may have flipped between empty and occupied, which changes the kind of every cell in it
+        for (int j = y0; j < y1; j++) {
+            for (int i = x0; i < x1; i++) {
+                kinds[i + j * w] = kind_of(map, i, j);
+            }
+        }
+    }
+
+    CellKind kind(const size_t index) const {
+        return CellKind(kinds[index]);
+    }
+
+    /*
+        Clearance in blocks of the block containing cell (x, y), 0 if the block is occupied
+    */
+    int block_clearance(const int x, const int y) const {
+        return clearance.distance(x >> BLOCK_SHIFT, y >> BLOCK_SHIFT);
+    }
+
+    bool operator==(const OccupancyHierarchy& other) const {
+        return w == other.w && h == other.h && blocks == other.blocks && clearance == other.clearance && kinds == other.kinds;
+    }
+
+private:
+    static std::string occupied_blocks(const char* map, const size_t map_w, const size_t map_h) {
+        const size_t blocks_w = (map_w + BLOCK_CELLS - 1) >> BLOCK_SHIFT;
+        const size_t blocks_h = (map_h + BLOCK_CELLS - 1) >> BLOCK_SHIFT;
+        std::string blocks(blocks_w * blocks_h, ' ');
+        for (size_t y = 0; y < map_h; y++) {
+            for (size_t x = 0; x < map_w; x++) {
+                if (map[x + y * map_w] != ' ') blocks[(x >> BLOCK_SHIFT) + (y >> BLOCK_SHIFT) * blocks_w] = '#';
+            }
+        }
+        return blocks;
+    }
+
+    uint8_t kind_of(const char* map, const size_t x, const size_t y) const {
+        if (map[x + y * w] != ' ')return CELL_WALL;
+        return blocks[(x >> BLOCK_SHIFT) + (y >> BLOCK_SHIFT) * blocks_w] != ' ' ? CELL_OPEN : CELL_IN_EMPTY_BLOCK;
+    }
+
+    size_t w, h;
+    size_t blocks_w, blocks_h;
+    std::string blocks;//one character per block, ' ' if it is empty, so the clearance is a DistanceField over it
+    DistanceField clearance;
+    std::vector<uint8_t> kinds;
+};
+
+/*
+    Count of the ray's grid lines on one axis, from line from on, that are at most limit away (below limit when strict)
+    This is the line the DDA loop is at once it reaches limit. inverse is 1 / delta, or near it, for the estimate.
+*/
+inline int grid_lines_until(const float first, const float delta, const float inverse, const int from, const float limit, const bool strict) {
+    auto within = [&](const int n) {
+        const float line = grid_line(first, delta, n);
+        return strict ? line < limit : line <= limit;
+    };
+    //the line after the estimate of the last one within limit is nearly always the answer. Checking it is a branch
+    //that predicts well, and keeps the rounding fix-up off the path the next block skip waits on. Comparisons
+    //with the NaN of an axis-parallel ray are false and keep from.
+    const float estimate = (limit - first) * inverse;
+    int n = estimate >= from ? (int)std::min(estimate, 1e9f) + 1 : from;
+    if (within(n) || (n > from && !within(n - 1))) {
+        while (within(n)) n++;
+        while (n > from && !within(n - 1)) n--;
+    }
+    return n;
+}
+
+/*
+    DDA ray cast that crosses empty squares of 8x8 blocks in one step instead of visiting each of their cells
+    Each step reads the kind of its cell in place of the map cell, and only a cell in an empty block looks up the
+    block's clearance and skips, so maps whose blocks are mostly occupied run close to the plain DDA loop. A skip
+    is carried across the square exactly: the grid lines each axis crosses before the ray leaves it are counted,
+    and the side distances are worked out from the counts as cast_ray works them out, so hits and distances are
+    bit-identical to cast_ray.
+*/
+RayHit cast_ray_hierarchical(const char* map, const size_t map_w, const size_t map_h, const OccupancyHierarchy& occupancy, const float ox, const float oy, const float dx, const float dy, const float max_dist) {
+    RayHit result = {};
+    int map_x = (int)std::floor(ox);
+    int map_y = (int)std::floor(oy);
+
+    const float delta_x = dx == 0.0f ? INFINITY : std::abs(1.0f / dx);
+    const float delta_y = dy == 0.0f ? INFINITY : std::abs(1.0f / dy);
+    const int step_x = dx < 0.0f ? -1 : 1;
+    const int step_y = dy < 0.0f ? -1 : 1;
+
+    const float first_x = dx < 0.0f ? (ox - map_x) * delta_x : (map_x + 1.0f - ox) * delta_x;
+    const float first_y = dy < 0.0f ? (oy - map_y) * delta_y : (map_y + 1.0f - oy) * delta_y;
+    float side_x = first_x, side_y = first_y;
+    int lines_x = 0, lines_y = 0;
+
+    float dist = 0.0f;
+    bool x_side = false;
+    CellKind kind = occupancy.kind(map_x + map_y * map_w);
+    for (;;) {
+        if (kind != CELL_IN_EMPTY_BLOCK) {
+            //plain DDA step, as in cast_ray
+            if (side_x < side_y) {
+                dist = side_x;
+                side_x = first_x + ++lines_x * delta_x;
+                map_x += step_x;
+                x_side = true;
+            } else {
+                dist = side_y;
+                side_y = first_y + ++lines_y * delta_y;
+                map_y += step_y;
+                x_side = false;
+            }
+            if (dist > max_dist || map_x < 0 || map_y < 0 || map_x >= (int)map_w || map_y >= (int)map_h) return result;
+            kind = occupancy.kind(map_x + map_y * map_w);
+            if (kind == CELL_WALL)break;
+            continue;
+        }
+
+        //the cell's block is empty, and so are the blocks around it out to its clearance. Skip to the exit of that square.
+        const int clearance = occupancy.block_clearance(map_x, map_y);
+        const int block_x = map_x >> OccupancyHierarchy::BLOCK_SHIFT;
+        const int block_y = map_y >> OccupancyHierarchy::BLOCK_SHIFT;
+        const int low_x = (block_x - clearance + 1) * OccupancyHierarchy::BLOCK_CELLS;
+        const int low_y = (block_y - clearance + 1) * OccupancyHierarchy::BLOCK_CELLS;
+        const int high_x = (block_x + clearance) * OccupancyHierarchy::BLOCK_CELLS - 1;
+        const int high_y = (block_y + clearance) * OccupancyHierarchy::BLOCK_CELLS - 1;
+        //grid lines crossed inside the square before the one leaving it, on each axis
+        const int cells_x = step_x > 0 ? high_x - map_x : map_x - low_x;
+        const int cells_y = step_y > 0 ? high_y - map_y : map_y - low_y;
+        const float exit_x = grid_line(first_x, delta_x, lines_x + cells_x);
+        const float exit_y = grid_line(first_y, delta_y, lines_y + cells_y);
+        //the other axis crosses the lines cast_ray would cross before the exit, with its tie rule. Which axis
+        //exits first follows no pattern, so both cases go through the same code instead of a branch.
+        const bool exits_x = exit_x < exit_y;
+        const int other = grid_lines_until(exits_x ? first_y : first_x, exits_x ? delta_y : delta_x, exits_x ? std::abs(dy) : std::abs(dx),
+            exits_x ? lines_y : lines_x, exits_x ? exit_x : exit_y, !exits_x);
+        const int to_x = exits_x ? lines_x + cells_x + 1 : other;
+        const int to_y = exits_x ? other : lines_y + cells_y + 1;
+        map_x += (to_x - lines_x) * step_x;
+        map_y += (to_y - lines_y) * step_y;
+        lines_x = to_x;
+        lines_y = to_y;
+        dist = exits_x ? exit_x : exit_y;
+        x_side = exits_x;
+        side_x = grid_line(first_x, delta_x, lines_x);
+        side_y = grid_line(first_y, delta_y, lines_y);
+        //distance and position only grow away from the map, so a ray that left it inside the square is still out
+        if (dist > max_dist || map_x < 0 || map_y < 0 || map_x >= (int)map_w || map_y >= (int)map_h) return result;
+        kind = occupancy.kind(map_x + map_y * map_w);
+        if (kind == CELL_WALL)break;
+    }
+
+    finish_hit(result, map, map_w, ox, oy, dx, dy, dist, map_x, map_y, x_side);
+    return result;
+}
+
+/*
+    Marches a ray through the map in small steps, the way the renderer worked before the DDA caster
+    Unlike the DDA it only samples the map at points, which is what effects such as thin walls build on.
+    field: if set, each step skips the empty space the field guarantees, otherwise the ray advances by 0.01
+    steps: if set, receives the number of map samples taken
+*/
+RayHit march_ray(const char* map, const size_t map_w, const size_t map_h, const DistanceField* field, const float ox, const float oy, const float dx, const float dy, const float max_dist, size_t* steps = nullptr) {
+    const float min_step = 0.01f;
+    RayHit result = {};
+    size_t n = 0;
+    float t = 0.0f;
+    float cx = ox, cy = oy;
+    for (;; n++) {
+        cx = ox + t * dx;
+        cy = oy + t * dy;
+        if (t > max_dist || cx < 0 || cy < 0 || cx >= map_w || cy >= map_h) {
+            if (steps) *steps = n;
+            return result;
+        }
+        if (map[(int)cx + (int)cy * map_w] != ' ')break;
+        t += field ? std::max(field->safe_distance(cx, cy), min_step) : min_step;
+    }
+    if (steps) *steps = n + 1;
+
+    result.hit = true;
+    result.dist = t;
+    result.map_x = (int)cx;
+    result.map_y = (int)cy;
+    result.cell = map[result.map_x + result.map_y * map_w];
+    //the face is on the axis whose coordinate is furthest from a grid line
+    float hitx = cx - std::floor(cx + 0.5f);
+    float hity = cy - std::floor(cy + 0.5f);
+    if (std::abs(hitx) > std::abs(hity)) {
+        result.texcoord = cx - std::floor(cx);
+        result.face = dy < 0.0f ? FACE_SOUTH : FACE_NORTH;
+    } else {
+        result.texcoord = cy - std::floor(cy);
+        result.face = dx < 0.0f ? FACE_EAST : FACE_WEST;
+    }
+    return result;
+}
+
+/*
+    Player view basis, recomputed once per frame with set_angle
+    dir: unit view direction
+    plane: camera plane perpendicular to dir, scaled so that dir +- plane are the edges of the fov
+*/
+struct Camera {
+    float x, y;
+    float angle;
+    float fov;
+    float dir_x, dir_y;
+    float plane_x, plane_y;
+
+    Camera(const float x, const float y, const float angle, const float fov) : x(x), y(y), angle(0), fov(fov) {
+        set_angle(angle);
+    }
+
+    void set_angle(const float a) {
+        angle = a;
+        const float plane_len = std::tan(fov / 2);
+        dir_x = std::cos(a);
+        dir_y = std::sin(a);
+        plane_x = -dir_y * plane_len;
+        plane_y = dir_x * plane_len;
+    }
+};
+
+/*
+    Per-column ray tables for a given screen width and fov, built once at startup
+    Columns are spaced at equal angles across the fov, so column i looks along angle + angle[i]
+    offset: position on the camera plane, the ray is dir + plane * offset
+    fisheye: cos(angle[i]), scales dir + plane * offset back to unit length and turns ray distance into perpendicular distance
+*/
+struct ColumnTable {
+    std::vector<float> angle;
+    std::vector<float> offset;
+    std::vector<float> fisheye;
+
+    ColumnTable(const size_t win_w, const float fov) : angle(win_w), offset(win_w), fisheye(win_w) {
+        const float plane_len = std::tan(fov / 2);
+        for (size_t i = 0; i < win_w; i++) {
+            angle[i] = -(fov / 2) + fov * (float(i) / win_w);
+            offset[i] = std::tan(angle[i]) / plane_len;
+            fisheye[i] = std::cos(angle[i]);
+        }
+    }
+};
+
+/*
+    Persistent pool of worker threads that split a range of work items into chunks
+    The calling thread works on chunks too, so a pool of size 1 runs everything on the caller.
+*/
+class ThreadPool {
+public:
+    /*
+        nthreads: total threads including the caller, 0 for one per hardware thread
+    */
+    explicit ThreadPool(size_t nthreads) {
+        if (nthreads == 0) nthreads = std::max(1u, std::thread::hardware_concurrency());
+        for (size_t i = 1; i < nthreads; i++) {
+            workers.emplace_back(&ThreadPool::worker_loop, this);
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (std::thread& t : workers) t.join();
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    size_t size() const {
+        return workers.size() + 1;
+    }
+
+    /*
+        Calls job(begin, end) for consecutive chunks of [0, count) across the pool and returns once all are done
+        The job is passed by reference and is not copied, so running a job does not allocate.
+    */
+    template <typename Job>
+    void parallel_for(const size_t count, const size_t chunk_size, Job& job) {
+        run(count, chunk_size, [](void* ctx, size_t begin, size_t end) { (*static_cast<Job*>(ctx))(begin, end); }, &job);
+    }
+
+private:
+    typedef void (*ChunkFn)(void* ctx, size_t begin, size_t end);
+
+    void run(const size_t count, const size_t chunk_size, ChunkFn fn, void* ctx) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            job_fn = fn;
+            job_ctx = ctx;
+            job_count = count;
+            job_chunk = std::max<size_t>(1, chunk_size);
+            next_item = 0;
+            busy = workers.size();
+            generation++;
+        }
+        wake.notify_all();
+        run_chunks();
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [this] { return busy == 0; });
+    }
+
+    void run_chunks() {
+        for (;;) {
+            size_t begin = next_item.fetch_add(job_chunk);
+            if (begin >= job_count)break;
+            job_fn(job_ctx, begin, std::min(begin + job_chunk, job_count));
+        }
+    }
+
+    void worker_loop() {
+        uint64_t seen = 0;
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [&] { return stopping || generation != seen; });
+                if (stopping)return;
+                seen = generation;
+            }
+            run_chunks();
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--busy == 0) done.notify_one();
+        }
+    }
+
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wake, done;
+    ChunkFn job_fn = nullptr;
+    void* job_ctx = nullptr;
+    size_t job_count = 0;
+    size_t job_chunk = 1;
+    std::atomic<size_t> next_item{ 0 };
+    size_t busy = 0;
+    uint64_t generation = 0;
+    bool stopping = false;
+};
+
+/*
+    Converts count packed colors to RGB24, dropping alpha
+    Colors are r,g,b,a in memory (see pack_color), so with SSSE3 one byte shuffle turns 4 pixels into 12 bytes.
+    Each 16 byte store runs 4 bytes past its 12, which the next store overwrites, so the vector loop stops
+    while at least 2 pixels remain and the scalar tail finishes.
+*/
+void pack_rgb24(const uint32_t* colors, const size_t count, uint8_t* rgb) {
+    size_t i = 0;
+#ifdef RAYMANCER_SSSE3
+    const __m128i drop_alpha = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    for (; i + 6 <= count; i += 4) {
+        const __m128i pixels = _mm_loadu_si128(reinterpret_cast<const __m128i*>(colors + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(rgb + i * 3), _mm_shuffle_epi8(pixels, drop_alpha));
+    }
+#endif
+    for (; i < count; i++) {
+        uint8_t a;
+        unpack_color(colors[i], rgb[i * 3 + 0], rgb[i * 3 + 1], rgb[i * 3 + 2], a);
+    }
+}
+
+/*
+    Transposes rows [y0, y1) of a column-major w*h image, columns[x * h + y], into row-major rows[x + (y - y0) * w]
+    Works in 8x8 tiles, down each group of 8 columns before moving right, so every column is read as whole cache lines
+    while only y1 - y0 rows are being written. With AVX2 a tile is 8 loads, a register transpose and 8 stores.
+*/
+void transpose_to_rows(const uint32_t* columns, const size_t w, const size_t h, const size_t y0, const size_t y1, uint32_t* rows) {
+    const size_t tiled_w = w / 8 * 8;
+    const size_t tiled_y1 = y0 + (y1 - y0) / 8 * 8;
+    for (size_t tx = 0; tx < tiled_w; tx += 8) {
+        for (size_t ty = y0; ty < tiled_y1; ty += 8) {
+            const uint32_t* src = columns + tx * h + ty;
+            uint32_t* dst = rows + (ty - y0) * w + tx;
+#ifdef RAYMANCER_AVX2
+            __m256i r[8];
+            for (int i = 0; i < 8; i++) r[i] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i * h));
+            //interleave pairs of columns, then pairs of pairs, then swap 128-bit halves between the two groups of four
+            __m256i t[8], u[8];
+            for (int i = 0; i < 8; i += 2) {
+                t[i] = _mm256_unpacklo_epi32(r[i], r[i + 1]);
+                t[i + 1] = _mm256_unpackhi_epi32(r[i], r[i + 1]);
+            }
+            for (int i = 0; i < 8; i += 4) {
+                u[i] = _mm256_unpacklo_epi64(t[i], t[i + 2]);
+                u[i + 1] = _mm256_unpackhi_epi64(t[i], t[i + 2]);
+                u[i + 2] = _mm256_unpacklo_epi64(t[i + 1], t[i + 3]);
+                u[i + 3] = _mm256_unpackhi_epi64(t[i + 1], t[i + 3]);
+            }
+            for (int i = 0; i < 4; i++) {
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i * w), _mm256_permute2x128_si256(u[i], u[i + 4], 0x20));
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + (i + 4) * w), _mm256_permute2x128_si256(u[i], u[i + 4], 0x31));
+            }
+#else
+            for (size_t i = 0; i < 8; i++) {
+                for (size_t j = 0; j < 8; j++) dst[j * w + i] = src[i * h + j];
+            }
+#endif
+        }
+    }
+    //columns right of the last whole tile, then rows below it
+    for (size_t x = tiled_w; x < w; x++) {
+        for (size_t y = y0; y < y1; y++) rows[x + (y - y0) * w] = columns[x * h + y];
+    }
+    for (size_t y = tiled_y1; y < y1; y++) {
+        for (size_t x = 0; x < tiled_w; x++) rows[x + (y - y0) * w] = columns[x * h + y];
+    }
+}
+
+/*
+    Encodes an image as a binary .ppm into out, replacing its contents
+*/
+void encode_ppm(const uint32_t* image, const size_t w, const size_t h, std::vector<uint8_t>& out, ThreadPool* = nullptr) {
+    std::stringstream header;
+    header << "P6\n" << w << " " << h << "\n255\n";
+    const std::string head = header.str();
+
+    out.resize(head.size() + w * h * 3);
+    std::memcpy(out.data(), head.data(), head.size());
+    pack_rgb24(image, w * h, out.data() + head.size());
+}
+
+/*
+    Encodes a column-major image, image[x * h + y], as a binary .ppm into out, replacing its contents
+    The transpose is fused with the RGB24 packing: 8 rows at a time are transposed into a buffer that stays in cache
+    and packed from there, so the frame is never written out in row-major order. With a pool, slices of 64 rows
+    are spread across it.
+*/
+void encode_ppm_columns(const uint32_t* image, const size_t w, const size_t h, std::vector<uint8_t>& out, ThreadPool* pool = nullptr) {
+    std::stringstream header;
+    header << "P6\n" << w << " " << h << "\n255\n";
+    const std::string head = header.str();
+
+    out.resize(head.size() + w * h * 3);
+    std::memcpy(out.data(), head.data(), head.size());
+    uint8_t* rgb = out.data() + head.size();
+    auto encode_rows = [&](size_t begin, size_t end) {
+        std::vector<uint32_t> band(w * 8);
+        for (size_t y0 = begin; y0 < end; y0 += 8) {
+            const size_t y1 = std::min(y0 + 8, end);
+            transpose_to_rows(image, w, h, y0, y1, band.data());
+            pack_rgb24(band.data(), w * (y1 - y0), rgb + y0 * w * 3);
+        }
+    };
+    if (pool) pool->parallel_for(h, 64, encode_rows);
+    else encode_rows(0, h);
+}
+
+/*
+    YUV4MPEG2 stream header for w*h frames in 4:2:0 at the given frame rate
+*/
+std::string y4m_header(const size_t w, const size_t h, const int fps) {
+    std::stringstream header;
+    header << "YUV4MPEG2 W" << w << " H" << h << " F" << fps << ":1 Ip A1:1 C420jpeg\n";
+    return header.str();
+}
+
+/*
+    Encodes an image as one Y4M frame into out, replacing its contents
+    Colors are converted to BT.601 limited range YUV with integer weights. Chroma is the average of each
+    2x2 block, so w and h must be even.
+*/
+void encode_y4m_frame(const uint32_t* image, const size_t w, const size_t h, std::vector<uint8_t>& out, ThreadPool* = nullptr) {
+    assert(w % 2 == 0 && h % 2 == 0);
+    static const char frame_header[] = "FRAME\n";
+    const size_t head = sizeof(frame_header) - 1;
+    out.resize(head + w * h * 3 / 2);
+    std::memcpy(out.data(), frame_header, head);
+    uint8_t* luma = out.data() + head;
+    uint8_t* cb = luma + w * h;
+    uint8_t* cr = cb + w * h / 4;
+
+    for (size_t y = 0; y < h; y += 2) {
+        for (size_t x = 0; x < w; x += 2) {
+            int r_sum = 0, g_sum = 0, b_sum = 0;
+            for (size_t j = 0; j < 2; j++) {
+                for (size_t i = 0; i < 2; i++) {
+                    const uint32_t color = image[x + i + (y + j) * w];
+                    const int r = color & 255, g = (color >> 8) & 255, b = (color >> 16) & 255;
+                    luma[x + i + (y + j) * w] = uint8_t(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+                    r_sum += r;
+                    g_sum += g;
+                    b_sum += b;
+                }
+            }
+            //sums of four samples, so shift by 2 more to average
+            const size_t c = x / 2 + y / 2 * (w / 2);
+            cb[c] = uint8_t(((-38 * r_sum - 74 * g_sum + 112 * b_sum + 512) >> 10) + 128);
+            cr[c] = uint8_t(((112 * r_sum - 94 * g_sum - 18 * b_sum + 512) >> 10) + 128);
+        }
+    }
+}
+
+/*
+    Encodes an image as a .qoi (Quite OK Image) into out, replacing its contents
+    Alpha is dropped as for .ppm, so the image is stored as 3 channel RGB. Runs of equal pixels, recently seen
+    colors and small differences from the previous pixel take 1 or 2 bytes, which covers the flat ceiling and floor
+    and the repeated texels of wall columns.
+*/
+void encode_qoi(const uint32_t* image, const size_t w, const size_t h, std::vector<uint8_t>& out, ThreadPool* = nullptr) {
+    //worst case is a 4 byte op per pixel, plus 14 byte header and 8 byte end marker
+    out.resize(14 + w * h * 4 + 8);
+    uint8_t* bytes = out.data();
+    size_t n = 0;
+    const uint8_t header[4] = { 'q', 'o', 'i', 'f' };
+    std::memcpy(bytes, header, 4);
+    n = 4;
+    for (const uint32_t size : { uint32_t(w), uint32_t(h) }) {
+        for (int shift = 24; shift >= 0; shift -= 8) bytes[n++] = uint8_t(size >> shift);
+    }
+    bytes[n++] = 3;//channels
+    bytes[n++] = 0;//sRGB with linear alpha
+
+    uint32_t index[64] = {};
+    uint32_t prev = pack_color(0, 0, 0);
+    const size_t count = w * h;
+    for (size_t i = 0; i < count; i++) {
+        const uint32_t color = image[i] | 0xff000000;
+        if (color == prev) {
+            //measure the whole run at once, then emit it 62 pixels per op
+            size_t run = 1;
+            while (i + run < count && (image[i + run] | 0xff000000) == prev) run++;
+            i += run - 1;
+            for (; run > 62; run -= 62) bytes[n++] = 0xc0 | 61;
+            bytes[n++] = uint8_t(0xc0 | (run - 1));
+            continue;
+        }
+
+        const int r = color & 255, g = (color >> 8) & 255, b = (color >> 16) & 255;
+        const size_t hash = (r * 3 + g * 5 + b * 7 + 255 * 11) % 64;
+        if (index[hash] == color) {
+            bytes[n++] = uint8_t(hash);
+        } else {
+            index[hash] = color;
+            //channel differences wrap around, as in the format
+            const int dr = int8_t(r - int(prev & 255));
+            const int dg = int8_t(g - int((prev >> 8) & 255));
+            const int db = int8_t(b - int((prev >> 16) & 255));
+            const int dr_dg = dr - dg, db_dg = db - dg;
+            if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+                bytes[n++] = uint8_t(0x40 | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2));
+            } else if (dg >= -32 && dg <= 31 && dr_dg >= -8 && dr_dg <= 7 && db_dg >= -8 && db_dg <= 7) {
+                bytes[n++] = uint8_t(0x80 | (dg + 32));
+                bytes[n++] = uint8_t((dr_dg + 8) << 4 | (db_dg + 8));
+            } else {
+                bytes[n++] = 0xfe;
+                bytes[n++] = uint8_t(r);
+                bytes[n++] = uint8_t(g);
+                bytes[n++] = uint8_t(b);
+            }
+        }
+        prev = color;
+    }
+    const uint8_t end_marker[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+    std::memcpy(bytes + n, end_marker, 8);
+    out.resize(n + 8);
+}
+
+//---------------------PNG---------------------
+
+/*
+    CRC-32 of data as used by PNG chunks, continuing from crc
+    Eight bytes are folded per step with eight tables, table k advancing a byte's CRC by k more zero bytes.
+*/
+uint32_t crc32(const uint8_t* data, size_t size, uint32_t crc = 0) {
+    static const std::vector<uint32_t> table = [] {
+        std::vector<uint32_t> t(8 * 256);
+        for (uint32_t n = 0; n < 256; n++) {
+            uint32_t c = n;
+            for (int k = 0; k < 8; k++) c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+            t[n] = c;
+        }
+        for (size_t k = 1; k < 8; k++) {
+            for (size_t n = 0; n < 256; n++) t[k * 256 + n] = (t[(k - 1) * 256 + n] >> 8) ^ t[t[(k - 1) * 256 + n] & 255];
+        }
+        return t;
+    }();
+    const uint32_t* t = table.data();
+    crc = ~crc;
+    for (; size >= 8; size -= 8, data += 8) {
+        const uint32_t lo = crc ^ (data[0] | data[1] << 8 | data[2] << 16 | uint32_t(data[3]) << 24);
+        const uint32_t hi = data[4] | data[5] << 8 | data[6] << 16 | uint32_t(data[7]) << 24;
+        crc = t[7 * 256 + (lo & 255)] ^ t[6 * 256 + ((lo >> 8) & 255)] ^ t[5 * 256 + ((lo >> 16) & 255)] ^ t[4 * 256 + (lo >> 24)]
+            ^ t[3 * 256 + (hi & 255)] ^ t[2 * 256 + ((hi >> 8) & 255)] ^ t[256 + ((hi >> 16) & 255)] ^ t[hi >> 24];
+    }
+    for (; size > 0; size--, data++) crc = t[(crc ^ *data) & 255] ^ (crc >> 8);
+    return ~crc;
+}
+
+/*
+    Adler-32 of data as used by zlib streams, continuing from adler
+*/
+uint32_t adler32(const uint8_t* data, size_t size, const uint32_t adler = 1) {
+    const uint32_t base = 65521;
+    uint32_t a = adler & 0xffff, b = adler >> 16;
+    while (size > 0) {
+        //5552 is the most bytes that can be summed before b overflows 32 bits
+        const size_t n = std::min<size_t>(size, 5552);
+        for (size_t i = 0; i < n; i++) {
+            a += data[i];
+            b += a;
+        }
+        a %= base;
+        b %= base;
+        data += n;
+        size -= n;
+    }
+    return a | (b << 16);
+}
+
+/*
+    Adler-32 of two buffers one after the other, from the checksum of each and the size of the second
+*/
+uint32_t adler32_combine(const uint32_t adler1, const uint32_t adler2, const size_t size2) {
+    const uint32_t base = 65521;
+    const uint32_t rem = uint32_t(size2 % base);
+    uint32_t a = adler1 & 0xffff;
+    uint32_t b = uint32_t(uint64_t(rem) * a % base);
+    a += (adler2 & 0xffff) + base - 1;
+    b += (adler1 >> 16) + (adler2 >> 16) + base - rem;
+    if (a >= base) a -= base;
+    if (a >= base) a -= base;
+    if (b >= base * 2) b -= base * 2;
+    if (b >= base) b -= base;
+    return a | (b << 16);
+}
+
+/*
+    Appends bits to a byte buffer least significant bit first, as deflate packs them
+    Bits are flushed 32 at a time, and all of them once align pads to a byte boundary.
+*/
+struct BitWriter {
+    std::vector<uint8_t>& out;
+    uint64_t bits = 0;
+    int count = 0;
+
+    explicit BitWriter(std::vector<uint8_t>& out) : out(out) {}
+
+    void put(const uint32_t value, const int n) {
+        bits |= uint64_t(value) << count;
+        count += n;
+        if (count >= 32) {
+            const uint8_t bytes[4] = { uint8_t(bits), uint8_t(bits >> 8), uint8_t(bits >> 16), uint8_t(bits >> 24) };
+            out.insert(out.end(), bytes, bytes + 4);
+            bits >>= 32;
+            count -= 32;
+        }
+    }
+
+    void align() {
+        for (; count > 0; count -= 8) {
+            out.push_back(uint8_t(bits));
+            bits >>= 8;
+        }
+        count = 0;
+    }
+};
+
+int floor_log2(uint32_t v) {
+    int log = 0;
+    while (v >>= 1) log++;
+    return log;
+}
+
+/*
+    Code lengths of a Huffman code for freqs no longer than max_bits, 0 for unused symbols
+    At least two symbols always get a code, since inflaters reject some single-code tables.
+    When the tree is too deep the frequencies are halved and it is rebuilt, which costs little on real data.
+*/
+void huffman_lengths(std::vector<uint32_t> freqs, const int max_bits, std::vector<uint8_t>& lengths) {
+    size_t used = 0;
+    for (uint32_t f : freqs) used += f > 0;
+    for (size_t i = 0; used < 2 && i < freqs.size(); i++) {
+        if (freqs[i] == 0) {
+            freqs[i] = 1;
+            used++;
+        }
+    }
+
+    lengths.assign(freqs.size(), 0);
+    for (;;) {
+        //leaves are the symbols, nodes past them are merged pairs
+        std::vector<uint64_t> weight;
+        std::vector<int> symbol, parent;
+        std::vector<std::pair<uint64_t, int>> heap;
+        for (size_t i = 0; i < freqs.size(); i++) {
+            if (freqs[i] == 0)continue;
+            heap.push_back(std::make_pair(uint64_t(freqs[i]), int(weight.size())));
+            weight.push_back(freqs[i]);
+            symbol.push_back(int(i));
+        }
+        const size_t leaves = weight.size();
+        parent.assign(leaves * 2, -1);
+        std::greater<std::pair<uint64_t, int>> later;
+        std::make_heap(heap.begin(), heap.end(), later);
+        while (heap.size() > 1) {
+            std::pop_heap(heap.begin(), heap.end(), later);
+            const std::pair<uint64_t, int> a = heap.back();
+            heap.pop_back();
+            std::pop_heap(heap.begin(), heap.end(), later);
+            const std::pair<uint64_t, int> b = heap.back();
+            heap.pop_back();
+            const int node = int(weight.size());
+            weight.push_back(a.first + b.first);
+            parent[a.second] = parent[b.second] = node;
+            heap.push_back(std::make_pair(a.first + b.first, node));
+            std::push_heap(heap.begin(), heap.end(), later);
+        }
+
+        int deepest = 0;
+        for (size_t i = 0; i < leaves; i++) {
+            int depth = 0;
+            for (int node = int(i); parent[node] >= 0; node = parent[node]) depth++;
+            lengths[symbol[i]] = uint8_t(depth);
+            deepest = std::max(deepest, depth);
+        }
+        if (deepest <= max_bits)return;
+        for (uint32_t& f : freqs) {
+            if (f > 0) f = (f + 1) / 2;
+        }
+    }
+}
+
+/*
+    Canonical Huffman codes for the lengths, bit reversed so they can be written least significant bit first
+*/
+void huffman_codes(const std::vector<uint8_t>& lengths, std::vector<uint16_t>& codes) {
+    uint16_t count[16] = {}, next[16] = {};
+    for (uint8_t len : lengths) count[len]++;
+    count[0] = 0;
+    for (int len = 1; len < 16; len++) next[len] = uint16_t((next[len - 1] + count[len - 1]) << 1);
+    codes.assign(lengths.size(), 0);
+    for (size_t i = 0; i < lengths.size(); i++) {
+        const int len = lengths[i];
+        if (len == 0)continue;
+        const uint16_t code = next[len]++;
+        uint16_t reversed = 0;
+        for (int bit = 0; bit < len; bit++) reversed |= ((code >> bit) & 1) << (len - 1 - bit);
+        codes[i] = reversed;
+    }
+}
+
+/*
+    Deflate length and distance symbols with their extra bits
+    Matches are stored in tokens with the top bit set, then the length in bits 16-24 and distance in bits 0-15.
+*/
+const uint32_t MATCH_TOKEN = 0x80000000;
+
+void length_symbol(const int length, int& symbol, int& extra_bits, int& extra) {
+    const int l = length - 3;
+    if (l < 8) {
+        symbol = 257 + l;
+        extra_bits = extra = 0;
+    } else if (l == 255) {
+        symbol = 285;
+        extra_bits = extra = 0;
+    } else {
+        const int log = floor_log2(l);
+        extra_bits = log - 2;
+        symbol = 257 + 4 * (log - 1) + ((l >> extra_bits) & 3);
+        extra = l & ((1 << extra_bits) - 1);
+    }
+}
+
+void distance_symbol(const int distance, int& symbol, int& extra_bits, int& extra) {
+    const int d = distance - 1;
+    if (d < 4) {
+        symbol = d;
+        extra_bits = extra = 0;
+    } else {
+        const int log = floor_log2(d);
+        extra_bits = log - 1;
+        symbol = 2 * log + ((d >> extra_bits) & 1);
+        extra = d & ((1 << extra_bits) - 1);
+    }
+}
+
+/*
+    Writes tokens as one non-final deflate block with dynamic Huffman codes built from their frequencies
+*/
+void write_dynamic_block(BitWriter& bits, const std::vector<uint32_t>& tokens) {
+    //literals are counted into four interleaved tables, so runs of one byte value do not wait on one counter
+    std::vector<uint32_t> counts(4 * 286, 0), dist_freqs(30, 0);
+    int symbol, extra_bits, extra;
+    for (size_t i = 0; i < tokens.size(); i++) {
+        const uint32_t token = tokens[i];
+        if (token & MATCH_TOKEN) {
+            length_symbol((token >> 16) & 0x1ff, symbol, extra_bits, extra);
+            counts[symbol]++;
+            distance_symbol(token & 0xffff, symbol, extra_bits, extra);
+            dist_freqs[symbol]++;
+        } else {
+            counts[(i & 3) * 286 + token]++;
+        }
+    }
+    std::vector<uint32_t> lit_freqs(286, 0);
+    for (size_t i = 0; i < 286; i++) lit_freqs[i] = counts[i] + counts[286 + i] + counts[572 + i] + counts[858 + i];
+    lit_freqs[256] = 1;//end of block
+    std::vector<uint8_t> lit_lengths, dist_lengths;
+    huffman_lengths(lit_freqs, 15, lit_lengths);
+    huffman_lengths(dist_freqs, 15, dist_lengths);
+    size_t hlit = 286, hdist = 30;
+    while (hlit > 257 && lit_lengths[hlit - 1] == 0) hlit--;
+    while (hdist > 1 && dist_lengths[hdist - 1] == 0) hdist--;
+
+    //run length code the two length tables as one sequence: 16 repeats the previous length, 17 and 18 are zero runs
+    std::vector<uint8_t> all_lengths(lit_lengths.begin(), lit_lengths.begin() + hlit);
+    all_lengths.insert(all_lengths.end(), dist_lengths.begin(), dist_lengths.begin() + hdist);
+    std::vector<std::pair<uint8_t, uint8_t>> runs;//code length symbol and its extra bits value
+    for (size_t i = 0; i < all_lengths.size();) {
+        const uint8_t len = all_lengths[i];
+        size_t run = 1;
+        while (i + run < all_lengths.size() && all_lengths[i + run] == len) run++;
+        if (len == 0 && run >= 3) {
+            run = std::min<size_t>(run, 138);
+            if (run <= 10) runs.push_back(std::make_pair(uint8_t(17), uint8_t(run - 3)));
+            else runs.push_back(std::make_pair(uint8_t(18), uint8_t(run - 11)));
+        } else if (len != 0 && run >= 4) {
+            run = std::min<size_t>(run, 7);
+            runs.push_back(std::make_pair(len, uint8_t(0)));
+            runs.push_back(std::make_pair(uint8_t(16), uint8_t(run - 4)));
+        } else {
+            run = 1;
+            runs.push_back(std::make_pair(len, uint8_t(0)));
+        }
+        i += run;
+    }
+    std::vector<uint32_t> cl_freqs(19, 0);
+    for (const std::pair<uint8_t, uint8_t>& run : runs) cl_freqs[run.first]++;
+    std::vector<uint8_t> cl_lengths;
+    huffman_lengths(cl_freqs, 7, cl_lengths);
+    static const uint8_t cl_order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+    size_t hclen = 19;
+    while (hclen > 4 && cl_lengths[cl_order[hclen - 1]] == 0) hclen--;
+
+    std::vector<uint16_t> lit_codes, dist_codes, cl_codes;
+    huffman_codes(lit_lengths, lit_codes);
+    huffman_codes(dist_lengths, dist_codes);
+    huffman_codes(cl_lengths, cl_codes);
+
+    bits.put(0, 1);//not final
+    bits.put(2, 2);//dynamic Huffman
+    bits.put(uint32_t(hlit - 257), 5);
+    bits.put(uint32_t(hdist - 1), 5);
+    bits.put(uint32_t(hclen - 4), 4);
+    for (size_t i = 0; i < hclen; i++) bits.put(cl_lengths[cl_order[i]], 3);
+    static const int run_extra_bits[19] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2, 3, 7 };
+    for (const std::pair<uint8_t, uint8_t>& run : runs) {
+        bits.put(cl_codes[run.first], cl_lengths[run.first]);
+        if (run_extra_bits[run.first]) bits.put(run.second, run_extra_bits[run.first]);
+    }
+
+    //a local copy keeps the bit buffer in registers, since byte stores to the output could alias the original
+    BitWriter local = bits;
+    for (uint32_t token : tokens) {
+        if (token & MATCH_TOKEN) {
+            length_symbol((token >> 16) & 0x1ff, symbol, extra_bits, extra);
+            local.put(lit_codes[symbol], lit_lengths[symbol]);
+            if (extra_bits) local.put(extra, extra_bits);
+            distance_symbol(token & 0xffff, symbol, extra_bits, extra);
+            local.put(dist_codes[symbol], dist_lengths[symbol]);
+            if (extra_bits) local.put(extra, extra_bits);
+        } else {
+            local.put(lit_codes[token], lit_lengths[token]);
+        }
+    }
+    local.put(lit_codes[256], lit_lengths[256]);
+    bits.bits = local.bits;
+    bits.count = local.count;
+}
+
+/*
+    Finds repeated strings in data with hash chains, producing literal and match tokens
+    max_chain: most earlier positions tried per byte, trading speed for ratio
+*/
+void lz77_tokens(const uint8_t* data, const size_t size, const int max_chain, std::vector<uint32_t>& tokens) {
+    const size_t window = 32768;
+    const int hash_bits = 15;
+    std::vector<int32_t> head(size_t(1) << hash_bits, -1);
+    std::vector<int32_t> prev(size);
+    auto hash = [data](size_t i) { return ((data[i] << 10) ^ (data[i + 1] << 5) ^ data[i + 2]) & ((1 << hash_bits) - 1); };
+    auto insert = [&](size_t i) {
+        const int h = hash(i);
+        prev[i] = head[h];
+        head[h] = int32_t(i);
+    };
+
+    tokens.clear();
+    size_t i = 0;
+    while (i < size) {
+        size_t best_len = 0, best_dist = 0;
+        if (i + 3 <= size) {
+            const size_t max_len = std::min<size_t>(258, size - i);
+            int chain = max_chain;
+            for (int32_t cand = head[hash(i)]; cand >= 0 && i - cand <= window && chain-- > 0; cand = prev[cand]) {
+                if (data[cand + best_len] != data[i + best_len])continue;
+                size_t len = 0;
+                while (len < max_len && data[cand + len] == data[i + len]) len++;
+                if (len > best_len) {
+                    best_len = len;
+                    best_dist = i - cand;
+                    if (len == max_len)break;
+                }
+            }
+            insert(i);
+        }
+        if (best_len >= 3) {
+            tokens.push_back(MATCH_TOKEN | uint32_t(best_len) << 16 | uint32_t(best_dist));
+            for (size_t j = i + 1; j < i + best_len && j + 3 <= size; j++) insert(j);
+            i += best_len;
+        } else {
+            tokens.push_back(data[i]);
+            i++;
+        }
+    }
+}
+
+/*
+    Deflate effort of the PNG writer
+    PNG_STORED: no compression, rows copied into stored blocks
+    PNG_HUFFMAN: Huffman coding of the filtered bytes only, no string matching
+    PNG_DEFLATE: string matching with hash chains, then Huffman coding
+*/
+enum PngLevel { PNG_STORED, PNG_HUFFMAN, PNG_DEFLATE };
+
+/*
+    Encodes an image as a .png into out, replacing its contents
+    Rows are split into slices that are filtered and deflated independently, in parallel on pool if given.
+    Each slice ends byte aligned with an empty stored block, so the slices join into one zlib stream and
+    their Adler-32 checksums combine without rereading the data.
+    Compressed levels use the up filter on every row: wall columns repeat texels vertically and the ceiling
+    and floor are flat, so most filtered bytes are zero.
+*/
+void encode_png(const uint32_t* image, const size_t w, const size_t h, std::vector<uint8_t>& out, const PngLevel level, ThreadPool* pool) {
+    const size_t slice_rows = 32;
+    const size_t nslices = (h + slice_rows - 1) / slice_rows;
+    const size_t row_bytes = 1 + w * 3;
+    std::vector<std::vector<uint8_t>> compressed(nslices);
+    std::vector<uint32_t> checksums(nslices);
+
+    auto encode_slices = [&](size_t begin, size_t end) {
+        std::vector<uint8_t> filtered;
+        std::vector<uint8_t> above(w * 3), row(w * 3);
+        std::vector<uint32_t> tokens;
+        for (size_t slice = begin; slice < end; slice++) {
+            const size_t y0 = slice * slice_rows, y1 = std::min(h, y0 + slice_rows);
+            filtered.resize((y1 - y0) * row_bytes);
+            if (y0 > 0) pack_rgb24(image + (y0 - 1) * w, w, above.data());
+            else std::fill(above.begin(), above.end(), uint8_t(0));
+            for (size_t y = y0; y < y1; y++) {
+                uint8_t* dst = filtered.data() + (y - y0) * row_bytes;
+                if (level == PNG_STORED) {
+                    dst[0] = 0;//none
+                    pack_rgb24(image + y * w, w, dst + 1);
+                    continue;
+                }
+                dst[0] = 2;//up
+                pack_rgb24(image + y * w, w, row.data());
+                for (size_t i = 0; i < w * 3; i++) dst[1 + i] = uint8_t(row[i] - above[i]);
+                std::swap(row, above);
+            }
+            checksums[slice] = adler32(filtered.data(), filtered.size());
+
+            std::vector<uint8_t>& bytes = compressed[slice];
+            bytes.clear();
+            bytes.reserve(filtered.size() + filtered.size() / 8 + 64);
+            BitWriter bits(bytes);
+            if (level == PNG_STORED) {
+                for (size_t pos = 0; pos < filtered.size(); pos += 65535) {
+                    const size_t len = std::min<size_t>(65535, filtered.size() - pos);
+                    bits.put(0, 3);//not final, stored
+                    bits.align();
+                    bits.put(uint32_t(len), 16);
+                    bits.put(uint32_t(~len & 0xffff), 16);
+                    bytes.insert(bytes.end(), filtered.begin() + pos, filtered.begin() + pos + len);
+                }
+                continue;
+            }
+            if (level == PNG_HUFFMAN) tokens.assign(filtered.begin(), filtered.end());
+            else lz77_tokens(filtered.data(), filtered.size(), 32, tokens);
+            write_dynamic_block(bits, tokens);
+            //empty stored block to end the slice on a byte boundary
+            bits.put(0, 3);
+            bits.align();
+            bits.put(0xffff0000, 32);
+        }
+    };
+    if (pool) pool->parallel_for(nslices, 1, encode_slices);
+    else encode_slices(0, nslices);
+
+    out.clear();
+    static const uint8_t signature[8] = { 137, 'P', 'N', 'G', '\r', '\n', 26, '\n' };
+    out.insert(out.end(), signature, signature + 8);
+    auto put32 = [&out](uint32_t v) {
+        for (int shift = 24; shift >= 0; shift -= 8) out.push_back(uint8_t(v >> shift));
+    };
+    //chunk length is patched in once the data is written, and the CRC covers type and data
+    size_t chunk_start = 0;
+    auto begin_chunk = [&](const char* type) {
+        chunk_start = out.size();
+        put32(0);
+        out.insert(out.end(), type, type + 4);
+    };
+    auto end_chunk = [&]() {
+        const uint32_t length = uint32_t(out.size() - chunk_start - 8);
+        for (int i = 0; i < 4; i++) out[chunk_start + i] = uint8_t(length >> (24 - i * 8));
+        put32(crc32(out.data() + chunk_start + 4, out.size() - chunk_start - 4));
+    };
+
+    begin_chunk("IHDR");
+    put32(uint32_t(w));
+    put32(uint32_t(h));
+    const uint8_t ihdr[5] = { 8, 2, 0, 0, 0 };//8 bit RGB, deflate, adaptive filtering, no interlace
+    out.insert(out.end(), ihdr, ihdr + 5);
+    end_chunk();
+
+    begin_chunk("IDAT");
+    out.push_back(0x78);//deflate with 32K window
+    out.push_back(0x01);
+    uint32_t adler = 1;
+    for (size_t slice = 0; slice < nslices; slice++) {
+        out.insert(out.end(), compressed[slice].begin(), compressed[slice].end());
+        const size_t slice_size = (std::min(h, (slice + 1) * slice_rows) - slice * slice_rows) * row_bytes;
+        adler = adler32_combine(adler, checksums[slice], slice_size);
+    }
+    const uint8_t final_block[5] = { 1, 0, 0, 0xff, 0xff };//empty final stored block
+    out.insert(out.end(), final_block, final_block + 5);
+    put32(adler);
+    end_chunk();
+
+    begin_chunk("IEND");
+    end_chunk();
+}
+
+void encode_png_stored(const uint32_t* image, const size_t w, const size_t h, std::vector<uint8_t>& out, ThreadPool* pool) {
+    encode_png(image, w, h, out, PNG_STORED, pool);
+}
+
+void encode_png_huffman(const uint32_t* image, const size_t w, const size_t h, std::vector<uint8_t>& out, ThreadPool* pool) {
+    encode_png(image, w, h, out, PNG_HUFFMAN, pool);
+}
+
+void encode_png_deflate(const uint32_t* image, const size_t w, const size_t h, std::vector<uint8_t>& out, ThreadPool* pool) {
+    encode_png(image, w, h, out, PNG_DEFLATE, pool);
+}
+
+/*
+    Writes a buffer to a file with a single write, returning false on failure
+*/
+bool write_file(const std::string filename, const std::vector<uint8_t>& bytes) {
+    std::ofstream ofs(filename, std::ofstream::out | std::ofstream::binary);
+    ofs.write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+    ofs.close();
+    if (!ofs) {
+        std::cerr << "Unable to write file: " << filename << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/*
+    Flushes a written file from the OS cache to storage, returning false on failure
+*/
+bool sync_file(const std::string filename) {
+#ifdef _WIN32
+    int fd = -1;
+    if (_sopen_s(&fd, filename.c_str(), _O_RDWR | _O_BINARY, _SH_DENYNO, _S_IREAD | _S_IWRITE) != 0) fd = -1;
+    const bool synced = fd >= 0 && _commit(fd) == 0;
+    if (fd >= 0) _close(fd);
+#else
+    const int fd = open(filename.c_str(), O_RDWR);
+    const bool synced = fd >= 0 && fsync(fd) == 0;
+    if (fd >= 0) close(fd);
+#endif
+    if (!synced) {
+        std::cerr << "Unable to sync file: " << filename << std::endl;
+    }
+    return synced;
+}
+
+/*
+    saves .ppm file which is a graphic representing a passed vector of colors
+    The header and pixels are encoded into one buffer and written with a single call.
+*/
+bool drop_ppm_image(const std::string filename, const std::vector<uint32_t> &image, const size_t w, const size_t h){
+    std::vector<uint8_t> bytes;
+    encode_ppm(image.data(), w, h, bytes);
+    return write_file(filename, bytes);
+}
+
+/*
+    Name of the player view file for a frame, 00001.ppm and up
+*/
+std::string frame_filename(const int frame, const char* extension = ".ppm") {
+    std::stringstream ss;
+    ss << std::setfill('0') << std::setw(5) << frame << extension;
+    return ss.str();
+}
+
+/*
+    Fixed capacity lock-free FIFO between exactly one producer thread and one consumer thread
+    push waits while the queue is full, pop waits while it is empty and returns false once closed and drained.
+    Waiting spins briefly, then yields, then sleeps, so a consumer stuck behind a slow disk costs no CPU.
+    close must be called by the producer, after its last push.
+*/
+template <typename T>
+class SpscQueue {
+public:
+    explicit SpscQueue(const size_t capacity) : slots(capacity) {}
+
+    void push(T item) {
+        const size_t tail_now = tail.load(std::memory_order_relaxed);
+        for (int spins = 0; tail_now - head.load(std::memory_order_acquire) == slots.size(); spins++) {
+            if (spins == 0) push_waits++;
+            backoff(spins);
+        }
+        slots[tail_now % slots.size()] = std::move(item);
+        tail.store(tail_now + 1, std::memory_order_release);
+    }
+
+    bool pop(T& item) {
+        const size_t head_now = head.load(std::memory_order_relaxed);
+        for (int spins = 0; head_now == tail.load(std::memory_order_acquire); spins++) {
+            //the last push happens before close, so recheck tail once closed is seen
+            if (closed.load(std::memory_order_acquire) && head_now == tail.load(std::memory_order_acquire)) return false;
+            if (spins == 0) pop_waits++;
+            backoff(spins);
+        }
+        item = std::move(slots[head_now % slots.size()]);
+        head.store(head_now + 1, std::memory_order_release);
+        return true;
+    }
+
+    void close() {
+        closed.store(true, std::memory_order_release);
+    }
+
+    //calls that had to wait, each only touched by the thread on that side of the queue
+    size_t push_waits = 0;
+    size_t pop_waits = 0;
+
+private:
+    static void backoff(const int spins) {
+        if (spins < 64) return;
+        if (spins < 128) std::this_thread::yield();
+        else std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+
+    std::vector<T> slots;
+    //counters only grow, the slot is the counter modulo capacity
+    alignas(64) std::atomic<size_t> head{ 0 };
+    alignas(64) std::atomic<size_t> tail{ 0 };
+    std::atomic<bool> closed{ false };
+};
+
+/*
+    w*h packed colors in 64-byte aligned storage, so vector loads and stores at the start of a frame never split a cache line
+    With huge_pages the storage is asked for on 2 MiB pages, which cover a whole frame with a few TLB entries: reserved
+    huge pages or else transparent ones on Linux, large pages on Windows (which need the lock pages in memory privilege).
+    When they cannot be had the frame falls back to normal pages and on_huge_pages() is false.
+    Move-only, and the storage never moves while the buffer lives.
+*/
+class FrameBuffer {
+public:
+    FrameBuffer(const size_t w, const size_t h, const bool huge_pages = false) : w(w), h(h) {
+        const size_t bytes = (w * h * sizeof(uint32_t) + 63) / 64 * 64;
+        if (huge_pages) map_huge_pages(bytes);
+        if (!pixels) pixels = static_cast<uint32_t*>(aligned_allocate(bytes));
+        std::memset(pixels, 0, bytes);
+    }
+
+    FrameBuffer(FrameBuffer&& other) noexcept : w(other.w), h(other.h), pixels(other.pixels), mapped_bytes(other.mapped_bytes) {
+        other.pixels = nullptr;
+    }
+
+    FrameBuffer& operator=(FrameBuffer&& other) noexcept {
+        std::swap(w, other.w);
+        std::swap(h, other.h);
+        std::swap(pixels, other.pixels);
+        std::swap(mapped_bytes, other.mapped_bytes);
+        return *this;
+    }
+
+    ~FrameBuffer() {
+        if (!pixels)return;
+#ifdef _WIN32
+        if (mapped_bytes) VirtualFree(pixels, 0, MEM_RELEASE);
+#else
+        if (mapped_bytes) munmap(pixels, mapped_bytes);
+#endif
+        else aligned_release(pixels);
+    }
+
+    FrameBuffer(const FrameBuffer&) = delete;
+    FrameBuffer& operator=(const FrameBuffer&) = delete;
+
+    uint32_t* data() {
+        return pixels;
+    }
+
+    const uint32_t* data() const {
+        return pixels;
+    }
+
+    size_t size() const {
+        return w * h;
+    }
+
+    uint32_t* begin() {
+        return pixels;
+    }
+
+    uint32_t* end() {
+        return pixels + w * h;
+    }
+
+    uint32_t& operator[](const size_t i) {
+        return pixels[i];
+    }
+
+    const uint32_t& operator[](const size_t i) const {
+        return pixels[i];
+    }
+
+    bool on_huge_pages() const {
+        return mapped_bytes != 0;
+    }
+
+private:
+    void map_huge_pages(const size_t bytes) {
+#ifdef _WIN32
+        const size_t large = GetLargePageMinimum();
+        if (large == 0)return;
+        const size_t rounded = (bytes + large - 1) / large * large;
+        pixels = static_cast<uint32_t*>(VirtualAlloc(nullptr, rounded, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE));
+        if (pixels) mapped_bytes = rounded;
+#elif defined(__linux__)
+        const size_t huge = size_t(2) << 20;
+        const size_t rounded = (bytes + huge - 1) / huge * huge;
+        void* view = mmap(nullptr, rounded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (view != MAP_FAILED) {
+            pixels = static_cast<uint32_t*>(view);
+            mapped_bytes = rounded;
+            return;
+        }
+        //no huge pages reserved, so map a 2 MiB aligned range and ask for transparent ones
+        view = mmap(nullptr, rounded + huge, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (view == MAP_FAILED)return;
+        uint8_t* start = static_cast<uint8_t*>(view);
+        uint8_t* aligned = reinterpret_cast<uint8_t*>((reinterpret_cast<uintptr_t>(start) + huge - 1) / huge * huge);
+        if (aligned > start) munmap(start, aligned - start);
+        if (aligned + rounded < start + rounded + huge) munmap(aligned + rounded, start + rounded + huge - (aligned + rounded));
+        if (madvise(aligned, rounded, MADV_HUGEPAGE) != 0) {
+            munmap(aligned, rounded);
+            return;
+        }
+        pixels = reinterpret_cast<uint32_t*>(aligned);
+        mapped_bytes = rounded;
+#else
+        (void)bytes;
+#endif
+    }
+
+    size_t w, h;
+    uint32_t* pixels = nullptr;
+    size_t mapped_bytes = 0;//set when pixels are mapped pages rather than from the heap
+};
+
+/*
+    Fixed set of frame buffers passed between the thread that renders into them and the one that gives them back
+    once encoded, so frames are recycled across the sequence and the pipeline stages instead of allocated per frame
+    acquire waits while every buffer is out. Only one thread may acquire and one other thread release.
+*/
+class FrameBufferPool {
+public:
+    FrameBufferPool(const size_t count, const size_t w, const size_t h, const bool huge_pages = false) : free_frames(count) {
+        frames.reserve(count);
+        for (size_t i = 0; i < count; i++) frames.emplace_back(w, h, huge_pages);
+        for (FrameBuffer& frame : frames) free_frames.push(&frame);
+    }
+
+    FrameBuffer& acquire() {
+        FrameBuffer* frame = nullptr;
+        free_frames.pop(frame);
+        return *frame;
+    }
+
+    void release(FrameBuffer& frame) {
+        free_frames.push(&frame);
+    }
+
+    /*
+        Number of acquire calls that had to wait for a buffer
+    */
+    size_t waits() const {
+        return free_frames.pop_waits;
+    }
+
+    bool on_huge_pages() const {
+        for (const FrameBuffer& frame : frames) {
+            if (!frame.on_huge_pages())return false;
+        }
+        return true;
+    }
+
+private:
+    std::vector<FrameBuffer> frames;
+    SpscQueue<FrameBuffer*> free_frames;
+};
+
+//---------------------COLUMN DELTA CONTAINER---------------------
+
+/*
+    Column delta sequence container (.rmc), all integers little endian
+    Header, 32 bytes: "RMCD", u32 version, u32 width, u32 height, u32 frame count, u32 keyframe interval, u64 index offset
+    Each frame is a kind byte (0 keyframe, 1 delta), a u32 run count and the runs. A run is an op byte and a u16 column count:
+        COLUMN_UNCHANGED: the columns equal the same columns of the previous frame
+        COLUMN_COPY: followed by an i16 offset, the columns equal the previous frame's columns that far to the right
+        COLUMN_LITERAL: followed by each column as a u16 count of vertical runs, each a u8 length and 3 RGB bytes
+    Keyframes hold only literal runs. After the last frame the index holds a u64 file offset and a kind byte per frame,
+    so a reader seeks to the last keyframe at or before the frame it wants and applies the deltas after it.
+*/
+enum ColumnOp { COLUMN_UNCHANGED, COLUMN_COPY, COLUMN_LITERAL };
+
+const uint32_t COLUMN_DELTA_VERSION = 1;
+const size_t COLUMN_DELTA_HEADER = 32;
+//largest frame width or height the decoder accepts, so a corrupt header cannot ask for an absurd allocation
+const size_t COLUMN_DELTA_MAX_SIZE = 16384;
+
+void put_le(std::vector<uint8_t>& out, const uint64_t value, const int bytes) {
+    for (int i = 0; i < bytes; i++) out.push_back(uint8_t(value >> (i * 8)));
+}
+
+uint64_t get_le(const uint8_t* data, const int bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++) value |= uint64_t(data[i]) << (i * 8);
+    return value;
+}
+
+/*
+    Encodes a sequence of frames into the column delta container, one frame at a time in order
+    Frames come in column-major as the renderer draws them, so every column is contiguous. Columns are matched
+    against the previous frame by a hash of each column and confirmed by comparing pixels, so the output is lossless.
+*/
+class ColumnDeltaEncoder {
+public:
+    /*
+        w, h: frame size, w below 32768 so column offsets fit
+        keyframe_interval: a keyframe every this many frames, the most deltas a seek has to apply plus one
+    */
+    ColumnDeltaEncoder(const size_t w, const size_t h, const size_t keyframe_interval)
+        : w(w), h(h), keyframe_interval(std::max<size_t>(1, keyframe_interval)), columns(w * h), prev(w * h), hashes(w), prev_hashes(w),
+        ops(w), offsets(w) {
+        assert(w < 32768 && h < 65536);
+    }
+
+    /*
+        Header of the sequence so far, written first and rewritten by finish
+    */
+    void header(std::vector<uint8_t>& out) const {
+        const uint8_t magic[4] = { 'R', 'M', 'C', 'D' };
+        out.insert(out.end(), magic, magic + 4);
+        put_le(out, COLUMN_DELTA_VERSION, 4);
+        put_le(out, w, 4);
+        put_le(out, h, 4);
+        put_le(out, frame_offsets.size(), 4);
+        put_le(out, keyframe_interval, 4);
+        put_le(out, next_offset, 8);
+    }
+
+    /*
+        Encodes the next frame from a column-major image, image[x * h + y], into out, replacing its contents
+    */
+    void encode_column_frame(const uint32_t* image, std::vector<uint8_t>& out) {
+        for (size_t i = 0; i < w * h; i++) columns[i] = image[i] & 0xffffff;
+        encode_columns(out);
+    }
+
+    /*
+        Appends the index after the last frame and rewrites the header, returning false on failure
+        file must hold the header and every encoded frame in order.
+    */
+    bool finish(std::ostream& file) const {
+        std::vector<uint8_t> bytes;
+        for (size_t i = 0; i < frame_offsets.size(); i++) {
+            put_le(bytes, frame_offsets[i], 8);
+            bytes.push_back(frame_kinds[i]);
+        }
+        file.write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+        bytes.clear();
+        header(bytes);
+        file.seekp(0);
+        file.write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+        file.flush();
+        return bool(file);
+    }
+
+private:
+    //encodes the frame held in columns and makes it the previous frame
+    void encode_columns(std::vector<uint8_t>& out) {
+        const bool key = frame_offsets.size() % keyframe_interval == 0;
+        for (size_t x = 0; x < w; x++) {
+            uint64_t hash = 0xcbf29ce484222325ull;
+            for (size_t y = 0; y < h; y++) hash = (hash ^ columns[y + x * h]) * 0x100000001b3ull;
+            hashes[x] = hash;
+        }
+
+        //classify every column, trying the offset of the column before first since pans shift whole runs alike
+        int offset = 0;
+        for (size_t x = 0; x < w; x++) {
+            ops[x] = COLUMN_LITERAL;
+            if (key)continue;
+            if (same_column(x, x)) {
+                ops[x] = COLUMN_UNCHANGED;
+                continue;
+            }
+            if (offset != 0 && int(x) + offset >= 0 && int(x) + offset < int(w) && same_column(x, x + offset)) {
+                ops[x] = COLUMN_COPY;
+                offsets[x] = offset;
+                continue;
+            }
+            auto it = std::lower_bound(prev_sorted.begin(), prev_sorted.end(), std::make_pair(hashes[x], uint32_t(0)));
+            for (; it != prev_sorted.end() && it->first == hashes[x]; ++it) {
+                if (same_column(x, it->second)) {
+                    ops[x] = COLUMN_COPY;
+                    offset = offsets[x] = int(it->second) - int(x);
+                    break;
+                }
+            }
+        }
+
+        out.clear();
+        out.push_back(key ? 0 : 1);
+        const size_t run_count_at = out.size();
+        put_le(out, 0, 4);
+        uint32_t runs = 0;
+        for (size_t x = 0; x < w;) {
+            size_t count = 1;
+            while (x + count < w && count < 65535 && ops[x + count] == ops[x] && (ops[x] != COLUMN_COPY || offsets[x + count] == offsets[x])) count++;
+            out.push_back(uint8_t(ops[x]));
+            put_le(out, count, 2);
+            if (ops[x] == COLUMN_COPY) put_le(out, uint16_t(int16_t(offsets[x])), 2);
+            if (ops[x] == COLUMN_LITERAL) {
+                for (size_t c = x; c < x + count; c++) put_literal_column(c, out);
+            }
+            runs++;
+            x += count;
+        }
+        for (int i = 0; i < 4; i++) out[run_count_at + i] = uint8_t(runs >> (i * 8));
+
+        prev.swap(columns);
+        prev_hashes.swap(hashes);
+        prev_sorted.clear();
+        for (size_t x = 0; x < w; x++) prev_sorted.push_back(std::make_pair(prev_hashes[x], uint32_t(x)));
+        std::sort(prev_sorted.begin(), prev_sorted.end());
+        frame_offsets.push_back(next_offset);
+        frame_kinds.push_back(key ? 0 : 1);
+        next_offset += out.size();
+    }
+
+    bool same_column(const size_t x, const size_t src) const {
+        return hashes[x] == prev_hashes[src] && std::memcmp(&columns[x * h], &prev[src * h], h * sizeof(uint32_t)) == 0;
+    }
+
+    void put_literal_column(const size_t x, std::vector<uint8_t>& out) const {
+        const size_t count_at = out.size();
+        put_le(out, 0, 2);
+        uint32_t runs = 0;
+        const uint32_t* column = &columns[x * h];
+        for (size_t y = 0; y < h;) {
+            const uint32_t color = column[y];
+            size_t len = 1;
+            while (y + len < h && len < 255 && column[y + len] == color) len++;
+            out.push_back(uint8_t(len));
+            put_le(out, color, 3);
+            runs++;
+            y += len;
+        }
+        out[count_at] = uint8_t(runs);
+        out[count_at + 1] = uint8_t(runs >> 8);
+    }
+
+    size_t w, h, keyframe_interval;
+    //this frame and the previous one, column-major without alpha
+    std::vector<uint32_t> columns, prev;
+    std::vector<uint64_t> hashes, prev_hashes;
+    std::vector<std::pair<uint64_t, uint32_t>> prev_sorted;
+    std::vector<uint8_t> ops;
+    std::vector<int> offsets;
+    std::vector<uint64_t> frame_offsets;
+    std::vector<uint8_t> frame_kinds;
+    uint64_t next_offset = COLUMN_DELTA_HEADER;
+};
+
+/*
+    Reconstructs one frame of a column delta file into image, resizing it to w*h
+    frame: 1 for the first frame, matching the numbering of the per-frame files
+    Only the index and the frames from the nearest keyframe on are read. Returns false on a bad or truncated file.
+*/
+bool decode_column_delta(const std::string filename, const size_t frame, std::vector<uint32_t>& image, size_t& w, size_t& h) {
+    std::ifstream file(filename, std::ifstream::in | std::ifstream::binary);
+    uint8_t header[COLUMN_DELTA_HEADER];
+    if (!file.read(reinterpret_cast<char*>(header), COLUMN_DELTA_HEADER) || std::memcmp(header, "RMCD", 4) != 0
+        || get_le(header + 4, 4) != COLUMN_DELTA_VERSION) {
+        std::cerr << "Not a column delta file: " << filename << std::endl;
+        return false;
+    }
+    w = size_t(get_le(header + 8, 4));
+    h = size_t(get_le(header + 12, 4));
+    const size_t frames = size_t(get_le(header + 16, 4));
+    const uint64_t index_offset = get_le(header + 24, 8);
+    file.seekg(0, std::ios::end);
+    const uint64_t file_size = uint64_t(file.tellg());
+    //sizes are checked against the file before anything is allocated from them
+    if (w == 0 || h == 0 || w > COLUMN_DELTA_MAX_SIZE || h > COLUMN_DELTA_MAX_SIZE
+        || index_offset < COLUMN_DELTA_HEADER || index_offset > file_size || (file_size - index_offset) / 9 < frames) {
+        std::cerr << "Corrupt column delta file: " << filename << std::endl;
+        return false;
+    }
+    if (frame < 1 || frame > frames) {
+        std::cerr << "Frame " << frame << " out of range, the file has " << frames << std::endl;
+        return false;
+    }
+
+    std::vector<uint8_t> index(frames * 9);
+    file.seekg(std::streamoff(index_offset));
+    if (!file.read(reinterpret_cast<char*>(index.data()), index.size())) {
+        std::cerr << "Truncated column delta index: " << filename << std::endl;
+        return false;
+    }
+    size_t first = frame - 1;
+    while (first > 0 && index[first * 9 + 8] != 0) first--;
+    const uint64_t begin = get_le(&index[first * 9], 8);
+    const uint64_t end = frame < frames ? get_le(&index[frame * 9], 8) : index_offset;
+    if (end < begin || begin < COLUMN_DELTA_HEADER || end > index_offset || index[first * 9 + 8] != 0) {
+        std::cerr << "Bad column delta index: " << filename << std::endl;
+        return false;
+    }
+    std::vector<uint8_t> data(size_t(end - begin));
+    file.seekg(std::streamoff(begin));
+    if (!file.read(reinterpret_cast<char*>(data.data()), data.size())) {
+        std::cerr << "Truncated column delta file: " << filename << std::endl;
+        return false;
+    }
+
+    image.assign(w * h, 0);
+    std::vector<uint32_t> prev(w * h);
+    size_t pos = 0;
+    auto corrupt = [&filename]() {
+        std::cerr << "Corrupt column delta file: " << filename << std::endl;
+        return false;
+    };
+    //every read is checked against the bytes left first
+    auto take = [&](const size_t bytes, uint64_t& value) {
+        if (data.size() - pos < bytes)return false;
+        value = get_le(&data[pos], int(bytes));
+        pos += bytes;
+        return true;
+    };
+    for (size_t f = first; f < frame; f++) {
+        image.swap(prev);
+        uint64_t kind, runs;
+        //a frame is a keyframe or a delta, as its index entry says
+        if (!take(1, kind) || kind > 1 || kind != index[f * 9 + 8] || !take(4, runs))return corrupt();
+        size_t x = 0;
+        for (uint64_t r = 0; r < runs; r++) {
+            uint64_t op, count, offset = 0;
+            if (!take(1, op) || !take(2, count) || x + count > w)return corrupt();
+            if (op == COLUMN_COPY && !take(2, offset))return corrupt();
+            const int shift = int16_t(uint16_t(offset));
+            for (size_t c = x; c < x + count; c++) {
+                if (op == COLUMN_LITERAL) {
+                    uint64_t nruns, len, color;
+                    if (!take(2, nruns))return corrupt();
+                    size_t y = 0;
+                    for (uint64_t i = 0; i < nruns; i++) {
+                        if (!take(1, len) || !take(3, color) || y + len > h)return corrupt();
+                        for (size_t j = y; j < y + len; j++) image[c + j * w] = uint32_t(color) | 0xff000000;
+                        y += size_t(len);
+                    }
+                    if (y != h)return corrupt();
+                } else {
+                    const int src = int(c) + (op == COLUMN_COPY ? shift : 0);
+                    if (op > COLUMN_LITERAL || src < 0 || src >= int(w))return corrupt();
+                    for (size_t y = 0; y < h; y++) image[c + y * w] = prev[src + y * w];
+                }
+            }
+            x += size_t(count);
+        }
+        if (x != w)return corrupt();
+    }
+    return true;
+}
+
+//---------------------TEXTURE CACHE---------------------
+
+/*
+    Read-only mapping of a whole file, whose pages are shared with every other process mapping it
+*/
+class MappedFile {
+public:
+    explicit MappedFile(const std::string filename) {
+#ifdef _WIN32
+        file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE)return;
+        LARGE_INTEGER file_size;
+        if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0)return;
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (!mapping)return;
+        bytes = static_cast<const uint8_t*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+        if (bytes) length = size_t(file_size.QuadPart);
+#else
+        const int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)return;
+        struct stat info;
+        if (fstat(fd, &info) == 0 && info.st_size > 0) {
+            void* view = mmap(nullptr, size_t(info.st_size), PROT_READ, MAP_SHARED, fd, 0);
+            if (view != MAP_FAILED) {
+                bytes = static_cast<const uint8_t*>(view);
+                length = size_t(info.st_size);
+            }
+        }
+        close(fd);//the mapping holds its own reference to the file
+#endif
+    }
+
+    ~MappedFile() {
+#ifdef _WIN32
+        if (bytes) UnmapViewOfFile(bytes);
+        if (mapping) CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+#else
+        if (bytes) munmap(const_cast<uint8_t*>(bytes), length);
+#endif
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool ok() const {
+        return bytes != nullptr;
+    }
+
+    const uint8_t* data() const {
+        return bytes;
+    }
+
+    size_t size() const {
+        return length;
+    }
+
+private:
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+#endif
+    const uint8_t* bytes = nullptr;
+    size_t length = 0;
+};
+
+/*
+    Texture cache file (.rmtex), a texture atlas block ready to be mapped and drawn from
+    Header, 64 bytes, integers little endian: "RMTX", u32 version, u64 source key, u32 texture size, u32 texture count,
+    u32 light levels, u32 palette size, u64 block bytes, zero padding
+    The block follows, laid out by TextureAtlas::layout in the byte order of the machine that built it. The source key is
+    the CRC-32 of the source image in the low half and its length in the high half. It is in the file name as well,
+    so a changed source gets a new cache file instead of replacing one that other processes have mapped.
+*/
+const uint32_t TEXTURE_CACHE_VERSION = 1;
+const size_t TEXTURE_CACHE_HEADER = 64;
+
+/*
+    Name of the cache file in cache_dir for the current contents of a texture source, empty if the source cannot be read
+    key: source key of the contents
+*/
+std::string texture_cache_file(const std::string filename, const std::string cache_dir, uint64_t& key) {
+    MappedFile source(filename);
+    if (!source.ok())return "";
+    key = crc32(source.data(), source.size()) | (uint64_t(source.size()) << 32);
+    std::stringstream name;
+    name << cache_dir << "/" << filename.substr(filename.find_last_of("/\\") + 1) << "." << std::hex << std::setfill('0') << std::setw(16) << key << ".rmtex";
+    return name.str();
+}
+
+/*
+    Loads a texture atlas like load_texture, through a cache file in cache_dir
+    A cache file for the current source is mapped read-only and drawn from directly. Otherwise the source is decoded
+    and the cache file written, under a temporary name moved into place so concurrent jobs never map a partial file.
+    A cache written without a palette counts as missing when palettize asks for one, and is written again with it.
+    Failing to write the cache is reported but still returns the decoded atlas.
+*/
+bool load_texture_cached(const std::string filename, const std::string cache_dir, TextureAtlas& atlas, const bool palettize = false) {
+    uint64_t key = 0;
+    const std::string cache_name = texture_cache_file(filename, cache_dir, key);
+    if (cache_name.empty()) {
+        std::cerr << "Unable to load texture: " << filename << std::endl;
+        return false;
+    }
+
+    std::shared_ptr<MappedFile> cache = std::make_shared<MappedFile>(cache_name);
+    if (cache->ok() && cache->size() >= TEXTURE_CACHE_HEADER) {
+        const uint8_t* header = cache->data();
+        const size_t size = get_le(header + 16, 4);
+        const size_t count = get_le(header + 20, 4);
+        const size_t colors = get_le(header + 28, 4);
+        const uint64_t block_bytes = get_le(header + 32, 8);
+        const bool valid = std::memcmp(header, "RMTX", 4) == 0 && get_le(header + 4, 4) == TEXTURE_CACHE_VERSION && get_le(header + 8, 8) == key
+            && size > 0 && size <= 65536 && count > 0 && count <= 65536 && get_le(header + 24, 4) == TextureAtlas::LIGHT_LEVELS && colors <= 256
+            && block_bytes == TextureAtlas::layout(size, count).bytes && cache->size() == TEXTURE_CACHE_HEADER + block_bytes
+            && (colors > 0 || !palettize);
+        if (valid) {
+            atlas.view(header + TEXTURE_CACHE_HEADER, size, count, colors, cache);
+            return true;
+        }
+    }
+    cache.reset();
+
+    if (!load_texture(filename, atlas, palettize))return false;
+    const size_t block_bytes = TextureAtlas::layout(atlas.size, atlas.count).bytes;
+    std::vector<uint8_t> bytes;
+    bytes.reserve(TEXTURE_CACHE_HEADER + block_bytes);
+    bytes.insert(bytes.end(), { 'R', 'M', 'T', 'X' });
+    put_le(bytes, TEXTURE_CACHE_VERSION, 4);
+    put_le(bytes, key, 8);
+    put_le(bytes, atlas.size, 4);
+    put_le(bytes, atlas.count, 4);
+    put_le(bytes, TextureAtlas::LIGHT_LEVELS, 4);
+    put_le(bytes, atlas.palette_size, 4);
+    put_le(bytes, block_bytes, 8);
+    bytes.resize(TEXTURE_CACHE_HEADER, 0);
+    bytes.insert(bytes.end(), atlas.block(), atlas.block() + block_bytes);
+
+#ifdef _WIN32
+    const int pid = _getpid();
+#else
+    const int pid = getpid();
+#endif
+    const std::string temp_name = cache_name + "." + std::to_string(pid) + ".tmp";
+    if (!write_file(temp_name, bytes)) {
+        std::cerr << "Texture cache not written: " << cache_name << std::endl;
+        return true;
+    }
+    //replacing matters when a cache without a palette is upgraded, and rename does not replace on Windows
+#ifdef _WIN32
+    const bool replaced = MoveFileExA(temp_name.c_str(), cache_name.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    const bool replaced = std::rename(temp_name.c_str(), cache_name.c_str()) == 0;
+#endif
+    if (!replaced) {
+        std::remove(temp_name.c_str());
+        std::cerr << "Texture cache not replaced: " << cache_name << std::endl;
+    }
+    return true;
+}
+
+//---------------------EMBEDDED ASSETS---------------------
+
+/*
+    Reads a map text file: one line per map row, all the same length, ' ' for empty cells and '0' + texid for walls
+    texture_count: textures in the atlas the walls index
+*/
+bool load_map(const std::string filename, const size_t texture_count, std::string& map, size_t& map_w, size_t& map_h) {
+    std::ifstream ifs(filename);
+    if (!ifs) {
+        std::cerr << "Unable to open map: " << filename << std::endl;
+        return false;
+    }
+    map.clear();
+    map_w = map_h = 0;
+    std::string row;
+    while (std::getline(ifs, row)) {
+        if (!row.empty() && row.back() == '\r') row.pop_back();
+        if (row.empty())continue;
+        if (map_h > 0 && row.size() != map_w) {
+            std::cerr << "Error: Map rows must all be the same length, row " << map_h + 1 << " of " << filename << " is not." << std::endl;
+            return false;
+        }
+        for (char cell : row) {
+            if (cell != ' ' && (cell < '0' || size_t(cell - '0') >= texture_count)) {
+                std::cerr << "Error: Map " << filename << " has a cell '" << cell << "' that is not a space or a texture id." << std::endl;
+                return false;
+            }
+        }
+        map_w = row.size();
+        map_h++;
+        map += row;
+    }
+    if (map_h == 0) {
+        std::cerr << "Error: Map " << filename << " is empty." << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/*
+    Generates a header of constexpr arrays holding a texture atlas block, already laid out as TextureAtlas::layout
+    with its mips, transposed columns, palette and colormaps, and optionally a map read by load_map.
+    Compiling with RAYMANCER_EMBEDDED_ASSETS defined and the header saved as embedded_assets.h next to this file
+    makes the renderer draw from them, with no asset reads at startup. The header must be generated again
+    whenever the source assets or the atlas layout change, which the compiler checks by version.
+    map_file: optional, empty to embed only the texture
+*/
+bool write_embedded_assets(const std::string texture_file, const std::string map_file, const std::string filename) {
+    TextureAtlas atlas;
+    if (!load_texture(texture_file, atlas, true))return false;
+    std::string map;
+    size_t map_w = 0, map_h = 0;
+    if (!map_file.empty() && !load_map(map_file, atlas.count, map, map_w, map_h))return false;
+
+    const size_t block_words = TextureAtlas::layout(atlas.size, atlas.count).bytes / sizeof(uint32_t);
+    const uint32_t* block = reinterpret_cast<const uint32_t*>(atlas.block());
+    std::stringstream ss;
+    ss << "//Generated by Raymancer embed from " << texture_file << (map_file.empty() ? "" : " and " + map_file) << ", do not edit\n";
+    ss << "#pragma once\n\n";
+    ss << "constexpr uint32_t EMBEDDED_LAYOUT_VERSION = " << TEXTURE_CACHE_VERSION << ";\n";
+    ss << "constexpr size_t EMBEDDED_LIGHT_LEVELS = " << TextureAtlas::LIGHT_LEVELS << ";\n";
+    ss << "constexpr size_t EMBEDDED_TEXTURE_SIZE = " << atlas.size << ";\n";
+    ss << "constexpr size_t EMBEDDED_TEXTURE_COUNT = " << atlas.count << ";\n";
+    ss << "constexpr size_t EMBEDDED_PALETTE_SIZE = " << atlas.palette_size << ";\n";
+    ss << "alignas(64) constexpr uint32_t EMBEDDED_TEXTURE_BLOCK[" << block_words << "] = {";
+    ss << std::hex << std::setfill('0');
+    for (size_t i = 0; i < block_words; i++) {
+        ss << (i % 8 == 0 ? "\n    " : " ") << "0x" << std::setw(8) << block[i] << ",";
+    }
+    ss << std::dec << "\n};\n";
+    if (!map.empty()) {
+        ss << "\n#define RAYMANCER_EMBEDDED_MAP\n";
+        ss << "constexpr size_t EMBEDDED_MAP_W = " << map_w << ";\n";
+        ss << "constexpr size_t EMBEDDED_MAP_H = " << map_h << ";\n";
+        ss << "constexpr char EMBEDDED_MAP[] =";
+        for (size_t j = 0; j < map_h; j++) ss << "\n    \"" << map.substr(j * map_w, map_w) << "\"";
+        ss << ";\n";
+    }
+    const std::string text = ss.str();
+    return write_file(filename, std::vector<uint8_t>(text.begin(), text.end()));
+}
+
+/*
+    Encodes a w*h frame into out, replacing its contents, using pool for encoders that split the frame
+*/
+typedef void (*FrameEncoder)(const uint32_t* image, const size_t w, const size_t h, std::vector<uint8_t>& out, ThreadPool* pool);
+
+/*
+    Output format of the player view frames: the encoder, and the extension of the per-frame files
+    encode takes row-major frames. encode_columns, if set, takes the renderer's column-major frames directly,
+    else they are transposed for encode first.
+*/
+struct FrameFormat {
+    const char* name;
+    FrameEncoder encode;
+    const char* extension;
+    FrameEncoder encode_columns;
+};
+
+const FrameFormat PPM_FRAMES = { "ppm", encode_ppm, ".ppm", encode_ppm_columns };
+const FrameFormat QOI_FRAMES = { "qoi", encode_qoi, ".qoi", nullptr };
+const FrameFormat PNG_STORED_FRAMES = { "png-stored", encode_png_stored, ".png", nullptr };
+const FrameFormat PNG_FAST_FRAMES = { "png-fast", encode_png_huffman, ".png", nullptr };
+const FrameFormat PNG_FRAMES = { "png", encode_png_deflate, ".png", nullptr };
+const FrameFormat Y4M_FRAMES = { "y4m", encode_y4m_frame, ".y4m", nullptr };
+const FrameFormat* const FRAME_FORMATS[] = { &PPM_FRAMES, &QOI_FRAMES, &PNG_STORED_FRAMES, &PNG_FAST_FRAMES, &PNG_FRAMES };
+
+#ifdef RAYMANCER_IO_URING
+/*
+    Linux io_uring writer for frame files, driven by raw syscalls
+    Each frame is submitted as one linked chain of open, write, optional fsync and close. The open installs the file
+    into a registered file slot, so the write and close can name the file before the open has completed. There is
+    one slot per frame in flight, so up to capacity frames are written concurrently with a single enter call each.
+    ok() is false when the kernel lacks io_uring or one of the operations, and the caller should write files itself.
+*/
+class UringWriter {
+public:
+    explicit UringWriter(const size_t capacity) : slots(capacity) {
+        io_uring_params params;
+        std::memset(&params, 0, sizeof(params));
+        ring_fd = int(syscall(__NR_io_uring_setup, unsigned(capacity * 4), &params));
+        if (ring_fd < 0)return;
+
+        sq_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+        cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP) sq_size = cq_size = std::max(sq_size, cq_size);
+        sq_ring = mmap(nullptr, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+        cq_ring = params.features & IORING_FEAT_SINGLE_MMAP ? sq_ring
+            : mmap(nullptr, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+        sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        void* sqes_map = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+        if (sq_ring == MAP_FAILED || cq_ring == MAP_FAILED || sqes_map == MAP_FAILED) {
+            if (sqes_map != MAP_FAILED) munmap(sqes_map, sqes_size);
+            return;
+        }
+        uint8_t* sq = static_cast<uint8_t*>(sq_ring);
+        uint8_t* cq = static_cast<uint8_t*>(cq_ring);
+        sq_tail = reinterpret_cast<uint32_t*>(sq + params.sq_off.tail);
+        sq_mask = *reinterpret_cast<uint32_t*>(sq + params.sq_off.ring_mask);
+        sq_array = reinterpret_cast<uint32_t*>(sq + params.sq_off.array);
+        cq_head = reinterpret_cast<uint32_t*>(cq + params.cq_off.head);
+        cq_tail = reinterpret_cast<uint32_t*>(cq + params.cq_off.tail);
+        cq_mask = *reinterpret_cast<uint32_t*>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+        sqes = static_cast<io_uring_sqe*>(sqes_map);
+        tail = *sq_tail;
+
+        //every operation of the chain must be known to this kernel
+        std::vector<uint8_t> probe_storage(sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op), 0);
+        io_uring_probe* probe = reinterpret_cast<io_uring_probe*>(probe_storage.data());
+        if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE, probe, 256) < 0)return;
+        for (int op : { IORING_OP_OPENAT, IORING_OP_WRITE, IORING_OP_FSYNC, IORING_OP_CLOSE }) {
+            if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED))return;
+        }
+        //empty slots the opens install into
+        std::vector<int> files(capacity, -1);
+        if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_FILES, files.data(), unsigned(capacity)) < 0)return;
+        if (!opens_direct())return;
+        for (size_t slot = 0; slot < capacity; slot++) free_slots.push_back(slot);
+        ready = true;
+    }
+
+    ~UringWriter() {
+        if (sqes) munmap(sqes, sqes_size);
+        if (cq_ring && cq_ring != MAP_FAILED && cq_ring != sq_ring) munmap(cq_ring, cq_size);
+        if (sq_ring && sq_ring != MAP_FAILED) munmap(sq_ring, sq_size);
+        if (ring_fd >= 0) close(ring_fd);
+    }
+
+    UringWriter(const UringWriter&) = delete;
+    UringWriter& operator=(const UringWriter&) = delete;
+
+    bool ok() const {
+        return ready;
+    }
+
+    size_t in_flight() const {
+        return slots.size() - free_slots.size();
+    }
+
+    size_t capacity() const {
+        return slots.size();
+    }
+
+    /*
+        Submits a frame file, returning its slot, or -1 if the submission failed and nothing is in flight for it
+        A slot must be free. The name is copied into the slot, bytes must stay unchanged until the slot comes back from wait.
+    */
+    int submit(const std::string& filename, const std::vector<uint8_t>& bytes, const bool sync) {
+        assert(!free_slots.empty());
+        const size_t slot = free_slots.back();
+        Slot& s = slots[slot];
+        s.filename = filename;
+        s.size = bytes.size();
+        s.failed = false;
+        s.pending = 0;
+
+        io_uring_sqe* open_sqe = next_sqe(slot, s);
+        open_sqe->opcode = IORING_OP_OPENAT;
+        open_sqe->fd = AT_FDCWD;
+        open_sqe->addr = reinterpret_cast<uint64_t>(s.filename.c_str());
+        open_sqe->len = 0644;
+        open_sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC;//O_CLOEXEC is refused for direct descriptors
+        open_sqe->file_index = uint32_t(slot + 1);//1-based, 0 would return a normal descriptor
+        open_sqe->flags = IOSQE_IO_LINK;
+        io_uring_sqe* write_sqe = next_sqe(slot, s);
+        write_sqe->opcode = IORING_OP_WRITE;
+        write_sqe->fd = int(slot);
+        write_sqe->addr = reinterpret_cast<uint64_t>(bytes.data());
+        write_sqe->len = uint32_t(bytes.size());
+        write_sqe->off = 0;
+        write_sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+        write_sqe->user_data |= WRITE_OP;
+        if (sync) {
+            io_uring_sqe* fsync_sqe = next_sqe(slot, s);
+            fsync_sqe->opcode = IORING_OP_FSYNC;
+            fsync_sqe->fd = int(slot);
+            fsync_sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+        }
+        io_uring_sqe* close_sqe = next_sqe(slot, s);
+        close_sqe->opcode = IORING_OP_CLOSE;
+        close_sqe->file_index = uint32_t(slot + 1);
+
+        s.start = std::chrono::steady_clock::now();
+        __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+        long submitted;
+        do {
+            submitted = syscall(__NR_io_uring_enter, ring_fd, s.pending, 0, 0, nullptr, 0);
+        } while (submitted < 0 && errno == EINTR);
+        if (submitted != long(s.pending)) {
+            //a partly submitted chain still completes through the ring, an unsubmitted one never will
+            if (submitted <= 0) {
+                tail -= s.pending;
+                __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+                return -1;
+            }
+            s.failed = true;
+        }
+        free_slots.pop_back();
+        return int(slot);
+    }
+
+    /*
+        Waits until a submitted frame is finished and returns its slot
+        success: the file was opened, completely written and closed
+        seconds: time from submission to the last completion of the chain
+        If the ring cannot be waited on any more, the error is reported, every frame in flight comes back failed
+        and ok() turns false, so the caller writes them and all later frames itself.
+    */
+    size_t wait(bool& success, double& seconds) {
+        assert(in_flight() > 0);
+        for (;;) {
+            if (finished()) {
+                const size_t slot = finished_slots.back();
+                finished_slots.pop_back();
+                free_slots.push_back(slot);
+                success = !slots[slot].failed;
+                seconds = slots[slot].seconds;
+                return slot;
+            }
+            if (syscall(__NR_io_uring_enter, ring_fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0) >= 0)continue;
+            //interrupted, or the completion queue is full and the next finished() drains it
+            if (errno == EINTR || errno == EBUSY)continue;
+            std::cerr << "io_uring wait failed: " << std::strerror(errno) << std::endl;
+            ready = false;
+            for (size_t slot = 0; slot < slots.size(); slot++) {
+                if (slots[slot].pending == 0)continue;
+                slots[slot].pending = 0;
+                slots[slot].failed = true;
+                finished_slots.push_back(slot);
+            }
+        }
+    }
+
+    /*
+        Returns true if wait would return a slot without blocking
+    */
+    bool finished() {
+        uint32_t head = *cq_head;
+        const uint32_t available = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != available; head++) {
+            const io_uring_cqe& cqe = cqes[head & cq_mask];
+            Slot& s = slots[cqe.user_data & ~WRITE_OP];
+            if (cqe.res < 0 || ((cqe.user_data & WRITE_OP) && size_t(cqe.res) != s.size)) s.failed = true;
+            if (--s.pending == 0) {
+                finished_slots.push_back(size_t(cqe.user_data & ~WRITE_OP));
+                s.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - s.start).count();
+            }
+        }
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+        return !finished_slots.empty();
+    }
+
+private:
+    //set in user_data on writes, whose result is checked against the frame size
+    static const uint64_t WRITE_OP = uint64_t(1) << 63;
+
+    struct Slot {
+        std::string filename;
+        size_t size = 0;
+        unsigned pending = 0;
+        bool failed = false;
+        std::chrono::steady_clock::time_point start;
+        double seconds = 0;
+    };
+
+    /*
+        Returns true if opens can install into a registered slot and closes can empty it again (Linux 5.15)
+        Older kernels ignore file_index and hand back an ordinary descriptor, which is closed here. Every
+        chain of submit depends on it, so without it the caller writes files itself.
+    */
+    bool opens_direct() {
+        Slot& s = slots[0];
+        io_uring_sqe* open_sqe = next_sqe(0, s);
+        open_sqe->opcode = IORING_OP_OPENAT;
+        open_sqe->fd = AT_FDCWD;
+        open_sqe->addr = reinterpret_cast<uint64_t>(".");
+        open_sqe->open_flags = O_RDONLY | O_DIRECTORY;
+        open_sqe->file_index = 1;
+        int result;
+        if (!run_one(result))return false;
+        if (result != 0) {
+            if (result > 0) close(result);
+            return false;
+        }
+        io_uring_sqe* close_sqe = next_sqe(0, s);
+        close_sqe->opcode = IORING_OP_CLOSE;
+        close_sqe->file_index = 1;
+        return run_one(result) && result == 0;
+    }
+
+    /*
+        Submits the one queued operation and waits for its result, for setup before any frame is in flight
+    */
+    bool run_one(int& result) {
+        __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+        slots[0].pending = 0;
+        long entered;
+        do {
+            entered = syscall(__NR_io_uring_enter, ring_fd, 1, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+        } while (entered < 0 && errno == EINTR);
+        if (entered != 1)return false;
+        uint32_t head = *cq_head;
+        while (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+            if (syscall(__NR_io_uring_enter, ring_fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0) < 0 && errno != EINTR)return false;
+        }
+        result = cqes[head & cq_mask].res;
+        __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+
+    io_uring_sqe* next_sqe(const size_t slot, Slot& s) {
+        const uint32_t index = tail & sq_mask;
+        io_uring_sqe* sqe = &sqes[index];
+        std::memset(sqe, 0, sizeof(*sqe));
+        sqe->user_data = slot;
+        sq_array[index] = index;
+        tail++;
+        s.pending++;
+        return sqe;
+    }
+
+    std::vector<Slot> slots;
+    std::vector<size_t> free_slots, finished_slots;
+    int ring_fd = -1;
+    bool ready = false;
+    void* sq_ring = nullptr;
+    void* cq_ring = nullptr;
+    size_t sq_size = 0, cq_size = 0, sqes_size = 0;
+    io_uring_sqe* sqes = nullptr;
+    io_uring_cqe* cqes = nullptr;
+    uint32_t* sq_tail = nullptr;
+    uint32_t* sq_array = nullptr;
+    uint32_t* cq_head = nullptr;
+    uint32_t* cq_tail = nullptr;
+    uint32_t sq_mask = 0, cq_mask = 0;
+    uint32_t tail = 0;
+};
+#endif
+
+/*
+    Where and how the frame pipeline writes frames
+    format: encoder run on every frame and extension of the frame files
+    stream: if set, every encoded frame is appended to it instead of written to frame_filename(index)
+    sync_writes: flush each frame file to storage before its buffer is reused
+    encode_pool: threads the encoder thread may split a frame across, separate from the render pool
+    delta: if set, frames are encoded by it into a column delta sequence instead of with format, for a stream
+    io_uring: write frame files through io_uring where the platform and kernel have it, else as usual
+*/
+struct FrameOutput {
+    const FrameFormat* format = &PPM_FRAMES;
+    std::ostream* stream = nullptr;
+    bool sync_writes = false;
+    ThreadPool* encode_pool = nullptr;
+    ColumnDeltaEncoder* delta = nullptr;
+    bool io_uring = false;
+};
+
+/*
+    Three stage frame pipeline: the caller renders frame N+1 while an encoder thread encodes frame N
+    and a writer thread writes frame N-1 to disk, either to its own file or appended to one stream.
+    Frames move between stages through lock-free single producer queues and a fixed set of pooled buffers,
+    so memory stays constant for any sequence length. When the writer falls behind, the pools and queues fill
+    and acquire_frame or submit_frame waits, which bounds how far rendering runs ahead of storage.
+    Each stage is a single thread, so frames are written in order. Frames are rendered column-major, and the encoder
+    stage only transposes them to rows for formats that cannot take columns.
+*/
+class FramePipeline {
+public:
+    /*
+        w, h: frame size
+        depth: frames that may wait between two stages
+        huge_pages: back the frame buffers with huge pages where possible
+    */
+    FramePipeline(const size_t w, const size_t h, const size_t depth, const FrameOutput& output = FrameOutput(), const bool huge_pages = false)
+        : w(w), h(h), output(output), frames(depth + 2, w, h, huge_pages), encoded_storage(depth + 2),
+        rendered(depth), free_encoded(depth + 2), encoded(depth) {
+        if (!output.delta && !output.format->encode_columns) rows.reset(new FrameBuffer(w, h));
+        for (std::vector<uint8_t>& bytes : encoded_storage) free_encoded.push(&bytes);
+        encoder = std::thread(&FramePipeline::encode_loop, this);
+        writer = std::thread(&FramePipeline::write_loop, this);
+    }
+
+    ~FramePipeline() {
+        finish();
+    }
+
+    FramePipeline(const FramePipeline&) = delete;
+    FramePipeline& operator=(const FramePipeline&) = delete;
+
+    /*
+        Returns a free w*h column-major frame to render into, waiting for one to come back from the encoder if none are free
+        Its contents are whatever the last frame rendered into it left behind.
+    */
+    FrameBuffer& acquire_frame() {
+        return frames.acquire();
+    }
+
+    /*
+        Hands a rendered frame from acquire_frame to the encoder, to be written as frame_filename(index, format->extension)
+    */
+    void submit_frame(const int index, FrameBuffer& pixels) {
+        rendered.push(RenderedFrame{ index, &pixels });
+    }
+
+    /*
+        Number of acquire_frame and submit_frame calls that had to wait for the encoder or writer
+        Only meaningful on the rendering thread.
+    */
+    size_t stalls() const {
+        return frames.waits() + rendered.push_waits;
+    }
+
+    bool on_huge_pages() const {
+        return frames.on_huge_pages();
+    }
+
+    /*
+        Prints how long frame files took from being handed to the OS until written and closed
+        Call after finish.
+    */
+    void report_writes(std::ostream& out) const {
+        if (write_seconds.empty())return;
+        std::vector<double> sorted(write_seconds);
+        std::sort(sorted.begin(), sorted.end());
+        double total = 0;
+        for (double seconds : sorted) total += seconds;
+        out << sorted.size() << " frame files written with " << (used_io_uring ? "io_uring" : "portable writes")
+            << std::fixed << std::setprecision(3) << ", latency ms mean " << total * 1000 / sorted.size()
+            << " p50 " << sorted[sorted.size() / 2] * 1000 << " p99 " << sorted[sorted.size() * 99 / 100] * 1000
+            << " max " << sorted.back() * 1000 << std::endl;
+    }
+
+    /*
+        Waits until every submitted frame has been written and stops the stage threads
+    */
+    void finish() {
+        if (finished)return;
+        finished = true;
+        rendered.close();
+        encoder.join();
+        writer.join();
+    }
+
+private:
+    struct RenderedFrame {
+        int index;
+        FrameBuffer* pixels;
+    };
+
+    struct EncodedFrame {
+        int index;
+        std::vector<uint8_t>* bytes;
+    };
+
+    void encode_loop() {
+        RenderedFrame frame;
+        while (rendered.pop(frame)) {
+            std::vector<uint8_t>* bytes = nullptr;
+            free_encoded.pop(bytes);
+            const uint32_t* columns = frame.pixels->data();
+            if (output.delta) {
+                output.delta->encode_column_frame(columns, *bytes);
+            } else if (output.format->encode_columns) {
+                output.format->encode_columns(columns, w, h, *bytes, output.encode_pool);
+            } else {
+                transpose_frame(columns);
+                output.format->encode(rows->data(), w, h, *bytes, output.encode_pool);
+            }
+            frames.release(*frame.pixels);
+            encoded.push(EncodedFrame{ frame.index, bytes });
+        }
+        encoded.close();
+    }
+
+    //transposes a column-major frame into rows, in bands across the encode pool if there is one
+    void transpose_frame(const uint32_t* columns) {
+        auto transpose_band = [&](size_t y0, size_t y1) {
+            transpose_to_rows(columns, w, h, y0, y1, rows->data() + y0 * w);
+        };
+        if (output.encode_pool) output.encode_pool->parallel_for(h, 64, transpose_band);
+        else transpose_band(0, h);
+    }
+
+    void write_loop() {
+#ifdef RAYMANCER_IO_URING
+        if (output.io_uring && !output.stream) {
+            //one buffer always stays with the encoder, else it and a full ring would wait on each other
+            UringWriter uring(encoded_storage.size() - 1);
+            if (uring.ok()) {
+                uring_write_loop(uring);
+                return;
+            }
+            std::cerr << "io_uring unavailable, using portable writes" << std::endl;
+        }
+#else
+        if (output.io_uring && !output.stream) std::cerr << "io_uring not supported on this platform, using portable writes" << std::endl;
+#endif
+        EncodedFrame frame;
+        while (encoded.pop(frame)) {
+            if (output.stream) {
+                output.stream->write(reinterpret_cast<const char*>(frame.bytes->data()), frame.bytes->size());
+                free_encoded.push(frame.bytes);
+                continue;
+            }
+            auto start = std::chrono::steady_clock::now();
+            write_frame_file(frame);
+            write_seconds.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+            free_encoded.push(frame.bytes);
+        }
+    }
+
+    void write_frame_file(const EncodedFrame& frame) {
+        const std::string filename = frame_filename(frame.index, output.format->extension);
+        if (write_file(filename, *frame.bytes) && output.sync_writes) sync_file(filename);
+    }
+
+#ifdef RAYMANCER_IO_URING
+    /*
+        Keeps every encoded buffer in flight in the ring, reaping the oldest finished frame when all slots are busy
+        A frame the ring failed to write is written again the portable way before its buffer is reused.
+    */
+    void uring_write_loop(UringWriter& uring) {
+        std::vector<EncodedFrame> in_slot(uring.capacity());
+        auto reap = [&]() {
+            bool success;
+            double seconds;
+            const size_t slot = uring.wait(success, seconds);
+            if (!success) write_frame_file(in_slot[slot]);
+            write_seconds.push_back(seconds);
+            free_encoded.push(in_slot[slot].bytes);
+        };
+        used_io_uring = true;
+        EncodedFrame frame;
+        while (encoded.pop(frame)) {
+            //buffers go back to the encoder as soon as their writes are done, not only when the ring is full
+            while (uring.in_flight() == uring.capacity() || (uring.in_flight() > 0 && uring.finished())) reap();
+            const int slot = uring.ok() ? uring.submit(frame_filename(frame.index, output.format->extension), *frame.bytes, output.sync_writes) : -1;
+            if (slot < 0) {
+                write_frame_file(frame);
+                free_encoded.push(frame.bytes);
+                continue;
+            }
+            in_slot[slot] = frame;
+        }
+        while (uring.in_flight() > 0) reap();
+    }
+#endif
+
+    size_t w, h;
+    FrameOutput output;
+    FrameBufferPool frames;
+    std::unique_ptr<FrameBuffer> rows;//row-major copy of the frame being encoded, for encoders that need one
+    std::vector<std::vector<uint8_t>> encoded_storage;
+    SpscQueue<RenderedFrame> rendered;
+    SpscQueue<std::vector<uint8_t>*> free_encoded;
+    SpscQueue<EncodedFrame> encoded;
+    std::thread encoder, writer;
+    //written by the writer thread, read after finish
+    std::vector<double> write_seconds;
+    bool used_io_uring = false;
+    bool finished = false;
+};
+
 /*
-* Extracts a column from a horizontal position of the desired texture in the passed image and stretches it to column_height 
-    img: texture image
-	texsize: image width or height (square, so same)
-	ntextures: number of textures in image
-	texid: which texture to be used
-	texcoord: which column of texture to be used
-	column_height: height of wall pixels to be drawn
+    Cache of ray hits around a fixed camera position, one ray per bin of absolute world angle
+    For sequences where the camera only rotates, one panoramic cast is shared by every frame and each
+    column looks up the bin nearest to its world angle instead of casting. Hits are exact at bin angles,
+    so the resolution should be at least the number of screen columns per full turn.
 */
-std::vector<uint32_t> texture_column(const std::vector<uint32_t>& img, const size_t texsize, const size_t ntextures, const size_t texid, const size_t texcoord, const size_t column_height) {
-    //Full image width should be texsize multiplied by amount of textures
-    const size_t img_w = texsize * ntextures;
-    const size_t img_h = texsize;
-    assert(img.size() == img_w * img_h && texcoord < texsize&& texid < ntextures);
+class PanoramaCache {
+public:
+    /*
+        resolution: number of bins per full turn
+    */
+    explicit PanoramaCache(const size_t resolution) : resolution(resolution), dir_x(resolution), dir_y(resolution), hits(resolution) {
+        for (size_t i = 0; i < resolution; i++) {
+            float a = 2 * M_PI * i / resolution;
+            dir_x[i] = std::cos(a);
+            dir_y[i] = std::sin(a);
+        }
+    }
 
-    std::vector<uint32_t> column(column_height);
-    
-    for (int y = 0; y < column_height; y++) {
-        size_t pix_x = texid * texsize + texcoord;
-        size_t pix_y = y * texsize / column_height;
+    /*
+        True if the cache was built at this camera position
+    */
+    bool valid_for(const float x, const float y) const {
+        return built && x == origin_x && y == origin_y;
+    }
+
+    /*
+        Casts every bin's ray from (x, y), spread across the pool
+    */
+    void build(const char* map, const CellGrid& grid, const float x, const float y, const float max_dist, ThreadPool& pool) {
+        auto cast_chunk = [&](size_t begin, size_t end) {
+            cast_rays(map, grid, x, y, dir_x.data() + begin, dir_y.data() + begin, end - begin, max_dist, hits.data() + begin);
+        };
+        pool.parallel_for(resolution, 256, cast_chunk);
+        origin_x = x;
+        origin_y = y;
+        built = true;
+    }
+
+    /*
+        Returns the cached hit for the bin nearest to a world angle in radians (any range)
+    */
+    const RayHit& sample(const float angle) const {
+        long long bin = std::llround(angle * (resolution / (2 * M_PI))) % (long long)resolution;
+        if (bin < 0) bin += resolution;
+        return hits[bin];
+    }
+
+private:
+    size_t resolution;
+    std::vector<float> dir_x, dir_y;
+    std::vector<RayHit> hits;
+    float origin_x = 0, origin_y = 0;
+    bool built = false;
+};
+
+/*
+    Everything the column renderer reads that stays the same from frame to frame
+*/
+struct RenderContext {
+    const char* map;
+    size_t map_w, map_h;
+    const CellGrid* grid;
+    const TextureAtlas* wallText;
+    const ColumnTable* columns;
+    size_t win_w, win_h;
+    float max_dist;
+    const PanoramaCache* panorama;//optional, used instead of casting when set
+    const DistanceField* march_field;//optional, march rays with this field instead of casting when set
+    const OccupancyHierarchy* occupancy;//optional, skip empty blocks while casting when set
+    bool mipmaps;//sample walls from the mip level matching their height
+    float shade_distance;//if above 0, walls are drawn through the palette, darkest at this distance
+    ColumnFill fill;//ceiling and floor colors, and whether columns are stored non-temporally
+};
+
+/*
+    Casts the rays for screen columns [begin, end) and draws them into screen, every pixel of each column
+    screen is column-major, screen[x * win_h + y], and encoders that need rows transpose it afterwards.
+    Each column only writes its own pixels and its own entries of ray_dir_x, ray_dir_y and hits,
+    so disjoint column ranges can be rendered on different threads.
+*/
+void render_columns(const RenderContext& ctx, const Camera& camera, uint32_t* screen, float* ray_dir_x, float* ray_dir_y, RayHit* hits, const size_t begin, const size_t end) {
+    const ColumnTable& columns = *ctx.columns;
+    for (size_t i = begin; i < end; i++) {
+        //ray through this column's point on the camera plane, scaled back to unit length
+        ray_dir_x[i] = (camera.dir_x + camera.plane_x * columns.offset[i]) * columns.fisheye[i];
+        ray_dir_y[i] = (camera.dir_y + camera.plane_y * columns.offset[i]) * columns.fisheye[i];
+    }
+    if (ctx.panorama) {
+        for (size_t i = begin; i < end; i++) hits[i] = ctx.panorama->sample(camera.angle + columns.angle[i]);
+    } else if (ctx.march_field) {
+        for (size_t i = begin; i < end; i++) {
+            hits[i] = march_ray(ctx.map, ctx.map_w, ctx.map_h, ctx.march_field, camera.x, camera.y, ray_dir_x[i], ray_dir_y[i], ctx.max_dist);
+        }
+    } else if (ctx.occupancy) {
+        for (size_t i = begin; i < end; i++) {
+            hits[i] = cast_ray_hierarchical(ctx.map, ctx.map_w, ctx.map_h, *ctx.occupancy, camera.x, camera.y, ray_dir_x[i], ray_dir_y[i], ctx.max_dist);
+        }
+    } else {
+        cast_rays(ctx.map, *ctx.grid, camera.x, camera.y, ray_dir_x + begin, ray_dir_y + begin, end - begin, ctx.max_dist, hits + begin);
+    }
 
-        column[y] = img[pix_x + pix_y * img_w];
+    for (size_t i = begin; i < end; i++) {
+        const RayHit& hit = hits[i];
+        if (!hit.hit) {
+            draw_column(screen, ctx.win_w, ctx.win_h, i, *ctx.wallText, 0, 0, 0, 0, nullptr, ctx.fill);
+            continue;
+        }
+
+        //-----------------FIND TEXTURE TEXTURE COORDINATE POSITION-----------------------
+        int x_texcoord = hit.texcoord * ctx.wallText->size;
+        if (x_texcoord >= (int)ctx.wallText->size) x_texcoord = ctx.wallText->size - 1;//texcoord just below 1 can round up
+        assert(x_texcoord >= 0 && x_texcoord < (int)ctx.wallText->size);
+
+        //get texture id from current wall collision
+        size_t texid = hit.cell - '0';
+        assert(texid < ctx.wallText->count);
+
+        //clamped so that walls right at the camera do not overflow the conversion
+        const uint64_t column_height = (uint64_t)std::min(ctx.win_h / (hit.dist * columns.fisheye[i]), 1e9f);
+        const size_t level = ctx.mipmaps ? ctx.wallText->mip_level(column_height) : 0;
+        const uint32_t* colormap = nullptr;
+        if (ctx.shade_distance > 0) {
+            //one light level per column, darkening with perpendicular distance
+            const size_t light = (size_t)(hit.dist * columns.fisheye[i] * TextureAtlas::LIGHT_LEVELS / ctx.shade_distance);
+            colormap = ctx.wallText->colormaps + std::min(light, TextureAtlas::LIGHT_LEVELS - 1) * 256;
+        }
+        draw_column(screen, ctx.win_w, ctx.win_h, i, *ctx.wallText, texid, x_texcoord, column_height, level, colormap, ctx.fill);
     }
-    return column;
+    if (ctx.fill.stream) stream_fence();
 }
 
+#ifdef RAYMANCER_FIXED_POINT
 /*
-    Draws a rectangle on the passed vector representing an image
+    16.16 fixed-point engine, selected at compile time with RAYMANCER_FIXED_POINT
+    Traversal, texture stepping and column scaling use integer arithmetic only, and the per-frame camera
+    and per-column tables come from an integer CORDIC instead of the C library's cos/sin/tan, so frames
+    are bit-identical across compilers, C libraries and instruction sets.
 */
-void draw_rectangle(std::vector<uint32_t> &img, const size_t img_w, const size_t img_h, const size_t x, const size_t y, const size_t w, const size_t h, const uint32_t color){
-    assert(img.size() == img_w * img_h);
-    for (int i = 0; i < w; i++) {
-        for (int j = 0; j < h; j++) {
-            size_t cx = x + i;
-            size_t cy = y + j;
-            if (cx >= img_w || cy >= img_h)continue;
-            img[cx + cy * img_w] = color;
+typedef int32_t fixed_t;
+const int FIXED_SHIFT = 16;
+const fixed_t FIXED_ONE = 1 << FIXED_SHIFT;
+
+fixed_t to_fixed(const float f) {
+    return (fixed_t)std::lround(f * FIXED_ONE);
+}
+
+fixed_t fixed_mul(const fixed_t a, const fixed_t b) {
+    return (fixed_t)(((int64_t)a * b) >> FIXED_SHIFT);
+}
+
+fixed_t fixed_div(const fixed_t a, const fixed_t b) {
+    return (fixed_t)(((int64_t)a << FIXED_SHIFT) / b);
+}
+
+/*
+    Sine and cosine of a 16.16 angle in radians, by CORDIC rotation in 2.30 fixed point
+*/
+void fixed_sincos(const fixed_t angle, fixed_t& sin_out, fixed_t& cos_out) {
+    static const int32_t atan_table[30] = {
+        843314857, 497837829, 263043837, 133525159, 67021687, 33543516, 16775851, 8388437, 4194283, 2097149,
+        1048576, 524288, 262144, 131072, 65536, 32768, 16384, 8192, 4096, 2048, 1024, 512, 256, 128, 64, 32, 16, 8, 4, 2 };
+    const int32_t cordic_gain = 652032874;//product of cos(atan(2^-i)), 2.30
+    const fixed_t pi = 205887, half_pi = 102944, two_pi = 411775;
+
+    //bring the angle into [-pi/2, pi/2], remembering whether the result flips sign
+    fixed_t a = angle % two_pi;
+    if (a > pi) a -= two_pi;
+    if (a < -pi) a += two_pi;
+    bool negate = false;
+    if (a > half_pi) {
+        a -= pi;
+        negate = true;
+    } else if (a < -half_pi) {
+        a += pi;
+        negate = true;
+    }
+
+    int32_t x = cordic_gain, y = 0;
+    int32_t z = a * (1 << 14);//16.16 to 2.30
+    for (int i = 0; i < 30; i++) {
+        int32_t nx;
+        if (z >= 0) {
+            nx = x - (y >> i);
+            y += x >> i;
+            z -= atan_table[i];
+        } else {
+            nx = x + (y >> i);
+            y -= x >> i;
+            z += atan_table[i];
         }
+        x = nx;
+    }
+    //round 2.30 back to 16.16
+    cos_out = (x + (1 << 13)) >> 14;
+    sin_out = (y + (1 << 13)) >> 14;
+    if (negate) {
+        cos_out = -cos_out;
+        sin_out = -sin_out;
     }
 }
 
 /*
-    packs four 8-bit color traits into a single 32-bit color
+    Fixed-point counterpart of Camera, recomputed once per frame with set_angle
 */
-uint32_t pack_color(const uint8_t r, const uint8_t g, const uint8_t b, const uint8_t a = 255){
-    return ((a<<24)+(b<<16)+(g<<8)+(r));
+struct FixedCamera {
+    fixed_t x, y;
+    fixed_t fov;
+    fixed_t dir_x, dir_y;
+    fixed_t plane_x, plane_y;
+
+    FixedCamera(const fixed_t x, const fixed_t y, const fixed_t angle, const fixed_t fov) : x(x), y(y), fov(fov) {
+        set_angle(angle);
+    }
+
+    void set_angle(const fixed_t a) {
+        fixed_t s, c;
+        fixed_sincos(fov / 2, s, c);
+        const fixed_t plane_len = fixed_div(s, c);
+        fixed_sincos(a, dir_y, dir_x);
+        plane_x = -fixed_mul(dir_y, plane_len);
+        plane_y = fixed_mul(dir_x, plane_len);
+    }
+};
+
+/*
+    Fixed-point counterpart of ColumnTable: camera plane offsets and fisheye factors per column
+*/
+struct FixedColumnTable {
+    std::vector<fixed_t> offset;
+    std::vector<fixed_t> fisheye;
+
+    FixedColumnTable(const size_t win_w, const fixed_t fov) : offset(win_w), fisheye(win_w) {
+        fixed_t s, c;
+        fixed_sincos(fov / 2, s, c);
+        const fixed_t plane_len = fixed_div(s, c);
+        for (size_t i = 0; i < win_w; i++) {
+            fixed_t angle = -(fov / 2) + (fixed_t)((int64_t)fov * i / win_w);
+            fixed_sincos(angle, s, c);
+            offset[i] = fixed_div(fixed_div(s, c), plane_len);
+            fisheye[i] = c;
+        }
+    }
+};
+
+/*
+    Fixed-point ray hit, fields as in RayHit
+*/
+struct FixedRayHit {
+    bool hit;
+    fixed_t dist;
+    int map_x, map_y;
+    char cell;
+    HitFace face;
+    fixed_t texcoord;
+};
+
+/*
+    cast_ray in 16.16 fixed point. Grid distances are kept in 64 bits so axis-parallel rays cannot overflow.
+*/
+FixedRayHit cast_ray_fixed(const char* map, const size_t map_w, const size_t map_h, const fixed_t ox, const fixed_t oy, const fixed_t dx, const fixed_t dy, const fixed_t max_dist) {
+    FixedRayHit result = {};
+    int map_x = ox >> FIXED_SHIFT;
+    int map_y = oy >> FIXED_SHIFT;
+
+    const int64_t infinite = INT64_MAX / 4;
+    const int64_t delta_x = dx == 0 ? infinite : ((int64_t)1 << (2 * FIXED_SHIFT)) / std::abs(dx);
+    const int64_t delta_y = dy == 0 ? infinite : ((int64_t)1 << (2 * FIXED_SHIFT)) / std::abs(dy);
+    const int step_x = dx < 0 ? -1 : 1;
+    const int step_y = dy < 0 ? -1 : 1;
+
+    const int64_t frac_x = ox & (FIXED_ONE - 1);
+    const int64_t frac_y = oy & (FIXED_ONE - 1);
+    int64_t side_x = dx == 0 ? infinite : ((dx < 0 ? frac_x : FIXED_ONE - frac_x) * delta_x) >> FIXED_SHIFT;
+    int64_t side_y = dy == 0 ? infinite : ((dy < 0 ? frac_y : FIXED_ONE - frac_y) * delta_y) >> FIXED_SHIFT;
+
+    int64_t dist = 0;
+    bool x_side = false;
+    for (;;) {
+        if (side_x < side_y) {
+            dist = side_x;
+            side_x += delta_x;
+            map_x += step_x;
+            x_side = true;
+        } else {
+            dist = side_y;
+            side_y += delta_y;
+            map_y += step_y;
+            x_side = false;
+        }
+        if (dist > max_dist || map_x < 0 || map_y < 0 || map_x >= (int)map_w || map_y >= (int)map_h) return result;
+        if (map[map_x + map_y * map_w] != ' ')break;
+    }
+
+    result.hit = true;
+    result.dist = (fixed_t)dist;
+    result.map_x = map_x;
+    result.map_y = map_y;
+    result.cell = map[map_x + map_y * map_w];
+    fixed_t wall = x_side ? oy + fixed_mul(result.dist, dy) : ox + fixed_mul(result.dist, dx);
+    result.texcoord = wall & (FIXED_ONE - 1);
+    if (x_side) {
+        result.face = dx < 0 ? FACE_EAST : FACE_WEST;
+    } else {
+        result.face = dy < 0 ? FACE_SOUTH : FACE_NORTH;
+    }
+    return result;
 }
 
 /*
-    Load texture from image file using the public stbi library
+    render_columns for the fixed-point engine
+    The float ray directions and hits it leaves behind are only for drawing the map view.
 */
-bool load_texture(const std::string filename, std::vector<uint32_t>& texture, size_t& text_size, size_t& text_cnt) {
-    int nchannels = -1, w, h;
+void render_columns_fixed(const RenderContext& ctx, const FixedCamera& camera, const FixedColumnTable& columns, uint32_t* screen, float* ray_dir_x, float* ray_dir_y, RayHit* hits, const size_t begin, const size_t end) {
+    const fixed_t max_dist = (fixed_t)ctx.max_dist << FIXED_SHIFT;
+    const fixed_t shade_distance = to_fixed(ctx.shade_distance);
+    for (size_t i = begin; i < end; i++) {
+        const fixed_t dx = fixed_mul(camera.dir_x + fixed_mul(camera.plane_x, columns.offset[i]), columns.fisheye[i]);
+        const fixed_t dy = fixed_mul(camera.dir_y + fixed_mul(camera.plane_y, columns.offset[i]), columns.fisheye[i]);
+        const FixedRayHit hit = cast_ray_fixed(ctx.map, ctx.map_w, ctx.map_h, camera.x, camera.y, dx, dy, max_dist);
 
-    unsigned char* pixmap = stbi_load(filename.c_str(), &w, &h, &nchannels, 0);
-    if (!pixmap) {
-        std::cerr << "Unable to load texture: " << filename << std::endl;
-        return false;
+        ray_dir_x[i] = float(dx) / FIXED_ONE;
+        ray_dir_y[i] = float(dy) / FIXED_ONE;
+        hits[i] = RayHit();
+        hits[i].hit = hit.hit;
+        hits[i].dist = float(hit.dist) / FIXED_ONE;
+        if (!hit.hit) {
+            draw_column(screen, ctx.win_w, ctx.win_h, i, *ctx.wallText, 0, 0, 0, 0, nullptr, ctx.fill);
+            continue;
+        }
+
+        const size_t x_texcoord = ((int64_t)hit.texcoord * ctx.wallText->size) >> FIXED_SHIFT;
+        const size_t texid = hit.cell - '0';
+        assert(texid < ctx.wallText->count);
+
+        const fixed_t perp = std::max<fixed_t>(1, fixed_mul(hit.dist, columns.fisheye[i]));
+        const uint64_t column_height = ((int64_t)ctx.win_h << FIXED_SHIFT) / perp;
+        const size_t level = ctx.mipmaps ? ctx.wallText->mip_level(column_height) : 0;
+        const uint32_t* colormap = nullptr;
+        if (shade_distance > 0) {
+            const size_t light = (size_t)(((int64_t)perp * TextureAtlas::LIGHT_LEVELS) / shade_distance);
+            colormap = ctx.wallText->colormaps + std::min(light, TextureAtlas::LIGHT_LEVELS - 1) * 256;
+        }
+        draw_column(screen, ctx.win_w, ctx.win_h, i, *ctx.wallText, texid, x_texcoord, column_height, level, colormap, ctx.fill);
     }
+    if (ctx.fill.stream) stream_fence();
+}
+#endif
 
-    if (nchannels != 4) {
-        std::cerr << "Error: Texture file " << filename << " must be a 32-bit image." << std::endl;
-        stbi_image_free(pixmap);
+/*
+    Draws the rays of a rendered frame onto the map image, one step per map image pixel
+    rect_w, rect_h: pixel size of a map cell on the map image
+*/
+void draw_map_rays(std::vector<uint32_t>& img, const size_t img_w, const size_t img_h, const Camera& camera, const float* ray_dir_x, const float* ray_dir_y, const RayHit* hits, const size_t nrays, const size_t rect_w, const size_t rect_h) {
+    const float ray_step = 1.0f / rect_w;
+    for (size_t i = 0; i < nrays; i++) {
+        if (!hits[i].hit)continue;
+        for (float s = 0; s < hits[i].dist; s += ray_step) {
+            size_t pix_x = (camera.x + s * ray_dir_x[i]) * rect_w;
+            size_t pix_y = (camera.y + s * ray_dir_y[i]) * rect_h;
+            if (pix_x >= img_w || pix_y >= img_h)continue;
+            img[pix_x + pix_y * img_w] = pack_color(255, 255, 255);
+        }
+    }
+}
+
+/*
+    Command line options
+    bench: run the benchmarks instead of rendering
+    threads: render threads, 0 for one per hardware thread
+    panorama: bins per turn of the panoramic hit cache, 0 to cast every frame
+    march: use the distance field ray marcher instead of the DDA caster
+    hierarchy: skip empty map blocks with the occupancy hierarchy, for large open maps. It pays off at around 0.1%
+        walls or fewer; on denser maps it runs up to about a third slower than the plain caster.
+    mipmaps: sample distant walls from smaller mip levels
+    shade: distance at which walls reach the darkest light level, 0 for unshaded full color
+    fsync: flush every frame file to storage as it is written, instead of leaving it to the OS
+    y4m: if set, write the player view frames as one Y4M video to this file instead, "-" for stdout
+    format: file format of the per-frame player views, one of FRAME_FORMATS
+    encode_threads: threads for encoders that split frames (png), 0 for one per hardware thread
+    delta: if set, write the player view frames as one column delta sequence to this file instead
+    keyframes: frames between keyframes of the column delta sequence
+    decode: column delta file to reconstruct decode_frame from into decode_out, instead of rendering
+    io_uring: write frame files through io_uring on Linux and report write latency
+    texture_cache: directory of texture cache files to map textures from instead of decoding them
+    embed: texture to write as a generated header to embed_out, with the map embed_map if set, instead of rendering
+    huge_pages: back the frame buffers with huge pages where the platform allows
+    stream_stores: draw frames with non-temporal stores
+*/
+struct Options {
+    bool bench = false;
+    size_t threads = 0;
+    size_t panorama = 0;
+    bool march = false;
+    bool hierarchy = false;
+    bool mipmaps = true;
+    float shade = 0;
+    bool fsync = false;
+    std::string y4m;
+    const FrameFormat* format = &PPM_FRAMES;
+    size_t encode_threads = 0;
+    std::string delta;
+    size_t keyframes = 30;
+    std::string decode;
+    size_t decode_frame = 0;
+    std::string decode_out;
+    bool io_uring = false;
+    std::string texture_cache;
+    std::string embed;
+    std::string embed_out;
+    std::string embed_map;
+    bool huge_pages = false;
+    bool stream_stores = false;
+};
+
+/*
+    Parses the command line into opts, printing usage and returning false on bad arguments
+*/
+bool parse_options(const int argc, char** argv, Options& opts) {
+    const char* usage = "Usage: Raymancer [bench | decode FILE.rmc FRAME OUT.ppm | embed TEXTURE.png OUT.h [--embed-map MAP.txt]] [--threads N] [--panorama BINS] [--march] [--hierarchy] [--no-mipmaps] [--shade DIST] [--fsync] [--y4m FILE] [--format ppm|qoi|png-stored|png-fast|png] [--encode-threads N] [--delta FILE.rmc] [--keyframes N] [--io-uring] [--texture-cache DIR] [--huge-pages] [--stream-stores]";
+    //numeric values must be a whole number in range, counts no sign; false after printing usage otherwise
+    bool valid = true;
+    auto invalid = [&](const std::string& arg, const char* text) {
+        if (valid) std::cerr << "Invalid number for " << arg << ": " << text << std::endl << usage << std::endl;
+        valid = false;
+    };
+    auto count = [&](const std::string& arg, const char* text) {
+        char* end;
+        errno = 0;
+        const unsigned long value = std::strtoul(text, &end, 10);
+        if (end == text || *end != '\0' || errno == ERANGE || std::strchr(text, '-')) invalid(arg, text);
+        return size_t(value);
+    };
+    auto real = [&](const std::string& arg, const char* text) {
+        char* end;
+        errno = 0;
+        const float value = std::strtof(text, &end);
+        if (end == text || *end != '\0' || errno == ERANGE || !std::isfinite(value)) invalid(arg, text);
+        return value;
+    };
+    for (int i = 1; i < argc && valid; i++) {
+        std::string arg = argv[i];
+        if (arg == "bench") {
+            opts.bench = true;
+        } else if (arg == "decode" && i + 3 < argc) {
+            opts.decode = argv[++i];
+            opts.decode_frame = count(arg, argv[++i]);
+            opts.decode_out = argv[++i];
+        } else if (arg == "embed" && i + 2 < argc) {
+            opts.embed = argv[++i];
+            opts.embed_out = argv[++i];
+        } else if (arg == "--embed-map" && i + 1 < argc) {
+            opts.embed_map = argv[++i];
+        } else if (arg == "--delta" && i + 1 < argc) {
+            opts.delta = argv[++i];
+        } else if (arg == "--io-uring") {
+            opts.io_uring = true;
+        } else if (arg == "--texture-cache" && i + 1 < argc) {
+            opts.texture_cache = argv[++i];
+        } else if (arg == "--keyframes" && i + 1 < argc) {
+            opts.keyframes = count(arg, argv[++i]);
+        } else if (arg == "--threads" && i + 1 < argc) {
+            opts.threads = count(arg, argv[++i]);
+        } else if (arg == "--panorama" && i + 1 < argc) {
+            opts.panorama = count(arg, argv[++i]);
+        } else if (arg == "--march") {
+            opts.march = true;
+        } else if (arg == "--hierarchy") {
+            opts.hierarchy = true;
+        } else if (arg == "--no-mipmaps") {
+            opts.mipmaps = false;
+        } else if (arg == "--shade" && i + 1 < argc) {
+            opts.shade = real(arg, argv[++i]);
+        } else if (arg == "--huge-pages") {
+            opts.huge_pages = true;
+        } else if (arg == "--stream-stores") {
+            opts.stream_stores = true;
+        } else if (arg == "--fsync") {
+            opts.fsync = true;
+        } else if (arg == "--y4m" && i + 1 < argc) {
+            opts.y4m = argv[++i];
+        } else if (arg == "--encode-threads" && i + 1 < argc) {
+            opts.encode_threads = count(arg, argv[++i]);
+        } else if (arg == "--format" && i + 1 < argc) {
+            const std::string name = argv[++i];
+            opts.format = nullptr;
+            for (const FrameFormat* format : FRAME_FORMATS) {
+                if (name == format->name) opts.format = format;
+            }
+            if (!opts.format) {
+                std::cerr << "Unknown frame format: " << name << std::endl;
+                return false;
+            }
+        } else {
+            std::cerr << "Unknown argument: " << arg << std::endl;
+            std::cerr << usage << std::endl;
+            return false;
+        }
+    }
+    return valid;
+}
+
+/*
+    Builds a square test map with solid borders and randomly placed walls
+    wall_ratio: fraction of inner cells that are walls
+*/
+std::string make_synthetic_map(const size_t size, const float wall_ratio, const unsigned seed) {
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<float> chance(0.0f, 1.0f);
+    std::string map(size * size, ' ');
+    for (size_t j = 0; j < size; j++) {
+        for (size_t i = 0; i < size; i++) {
+            bool border = i == 0 || j == 0 || i == size - 1 || j == size - 1;
+            if (border || chance(rng) < wall_ratio) map[i + j * size] = '0' + rng() % 6;
+        }
+    }
+    map[size / 2 + size / 2 * size] = ' ';//keep the ray origin clear
+    return map;
+}
+
+/*
+    Times the scalar and packet ray casters on a fan of rays around (ox, oy) and checks that both give identical hits
+    The packet caster is timed on every map, and the report says which of the two cast_rays uses for it.
+    nrays: a multiple of 8
+*/
+void benchmark_ray_casters(const std::string name, const char* map, const size_t map_w, const size_t map_h, const float ox, const float oy, const size_t nrays) {
+    const CellGrid grid(map, map_w, map_h);
+    const float max_dist = float(map_w + map_h);
+    std::vector<float> dx(nrays), dy(nrays);
+    for (size_t i = 0; i < nrays; i++) {
+        float a = 2 * M_PI * i / nrays;
+        dx[i] = std::cos(a);
+        dy[i] = std::sin(a);
+    }
+    std::vector<RayHit> scalar_hits(nrays), packet_hits(nrays);
+    for (size_t i = 0; i < nrays; i++) scalar_hits[i] = cast_ray(map, map_w, map_h, ox, oy, dx[i], dy[i], max_dist);
+    bool packets = false;
+#ifdef RAYMANCER_AVX2
+    for (size_t i = 0; i + 8 <= nrays; i += 8) cast_ray_packet(map, grid, ox, oy, &dx[i], &dy[i], max_dist, &packet_hits[i]);
+#else
+    cast_rays(map, grid, ox, oy, dx.data(), dy.data(), nrays, max_dist, packet_hits.data());
+#endif
+    //the same timing choose_ray_caster makes, so the report says what renders from (ox, oy) would pick
+    const CasterRates rates = time_ray_casters(map, grid, ox, oy, max_dist, CASTER_PROBE_RAYS, CASTER_PROBE_ROUNDS);
+#ifdef RAYMANCER_AVX2
+    packets = rates.packet > rates.scalar;
+#endif
+
+    size_t mismatches = 0;
+    for (size_t i = 0; i < nrays; i++) {
+        const RayHit& a = scalar_hits[i];
+        const RayHit& b = packet_hits[i];
+        bool same = a.hit == b.hit;
+        if (same && a.hit) {
+            same = std::memcmp(&a.dist, &b.dist, sizeof(float)) == 0 && std::memcmp(&a.texcoord, &b.texcoord, sizeof(float)) == 0
+                && a.map_x == b.map_x && a.map_y == b.map_y && a.cell == b.cell && a.face == b.face;
+        }
+        if (!same)mismatches++;
+    }
+
+    std::cout << std::setw(24) << std::left << name << std::right
+        << " scalar " << std::setw(8) << std::fixed << std::setprecision(2) << rates.scalar / 1e6 << " Mrays/s"
+        << "  packet " << std::setw(8) << rates.packet / 1e6 << " Mrays/s"
+        << "  speedup " << std::setprecision(2) << rates.packet / rates.scalar << "x"
+        << "  mismatches " << mismatches << "  renders cast " << (packets ? "packets" : "scalar") << std::endl;
+}
+
+/*
+    Times the flat DDA caster against the hierarchical caster on a fan of rays and counts rays that hit different cells
+    Returns false if any did, as the hierarchical caster must match cast_ray exactly.
+*/
+bool benchmark_hierarchy(const std::string name, const char* map, const size_t map_w, const size_t map_h, const float ox, const float oy, const size_t nrays) {
+    const OccupancyHierarchy occupancy(map, map_w, map_h);
+    const float max_dist = float(map_w + map_h);
+    std::vector<float> dx(nrays), dy(nrays);
+    for (size_t i = 0; i < nrays; i++) {
+        float a = 2 * M_PI * i / nrays;
+        dx[i] = std::cos(a);
+        dy[i] = std::sin(a);
+    }
+    std::vector<RayHit> flat_hits(nrays), hierarchy_hits(nrays);
+
+    double flat_rate = 0, hierarchy_rate = 0;
+    for (int kernel = 0; kernel < 2; kernel++) {
+        size_t rays = 0;
+        auto start = std::chrono::steady_clock::now();
+        double elapsed = 0;
+        while (elapsed < 0.25) {
+            for (size_t i = 0; i < nrays; i++) {
+                if (kernel == 0) flat_hits[i] = cast_ray(map, map_w, map_h, ox, oy, dx[i], dy[i], max_dist);
+                else hierarchy_hits[i] = cast_ray_hierarchical(map, map_w, map_h, occupancy, ox, oy, dx[i], dy[i], max_dist);
+            }
+            rays += nrays;
+            elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        }
+        (kernel == 0 ? flat_rate : hierarchy_rate) = rays / elapsed;
+    }
+
+    size_t mismatches = 0;
+    for (size_t i = 0; i < nrays; i++) {
+        const RayHit& a = flat_hits[i];
+        const RayHit& b = hierarchy_hits[i];
+        if (a.hit != b.hit || (a.hit && (a.map_x != b.map_x || a.map_y != b.map_y || a.face != b.face)))mismatches++;
+    }
+
+    std::cout << std::setw(24) << std::left << name << std::right << std::fixed << std::setprecision(2)
+        << " flat " << std::setw(8) << flat_rate / 1e6 << " Mrays/s"
+        << "  hierarchy " << std::setw(8) << hierarchy_rate / 1e6 << " Mrays/s"
+        << "  speedup " << hierarchy_rate / flat_rate << "x"
+        << "  different cells " << mismatches << std::endl;
+    if (mismatches > 0) {
+        std::cerr << name << ": hierarchical caster hit different cells than cast_ray" << std::endl;
         return false;
     }
+    return true;
+}
 
-    text_cnt = w / h;
-    text_size = w / text_cnt;
-    if (w != h * (int)text_cnt) {
-        std::cerr << "Error: The texture file must be N square textures packed horizontally." << std::endl;
-        stbi_image_free(pixmap);
+/*
+    Compares map samples per ray for the constant-step marcher and the distance field marcher on a fan of rays
+*/
+void benchmark_ray_marcher(const std::string name, const char* map, const size_t map_w, const size_t map_h, const float ox, const float oy, const size_t nrays) {
+    const DistanceField field(map, map_w, map_h);
+    const float max_dist = float(map_w + map_h);
+    size_t fixed_steps = 0, field_steps = 0, mismatches = 0;
+    for (size_t i = 0; i < nrays; i++) {
+        float a = 2 * M_PI * i / nrays;
+        size_t n;
+        RayHit fixed_hit = march_ray(map, map_w, map_h, nullptr, ox, oy, std::cos(a), std::sin(a), max_dist, &n);
+        fixed_steps += n;
+        RayHit field_hit = march_ray(map, map_w, map_h, &field, ox, oy, std::cos(a), std::sin(a), max_dist, &n);
+        field_steps += n;
+        if (fixed_hit.map_x != field_hit.map_x || fixed_hit.map_y != field_hit.map_y)mismatches++;
+    }
+    std::cout << std::setw(24) << std::left << name << std::right << std::fixed << std::setprecision(1)
+        << " fixed step " << std::setw(8) << double(fixed_steps) / nrays << " samples/ray"
+        << "  distance field " << std::setw(6) << double(field_steps) / nrays << " samples/ray"
+        << "  different cells " << mismatches << std::endl;
+}
+
+/*
+    Toggles random cells of a map, updating a distance field and an occupancy hierarchy cell by cell,
+    and checks both against ones built from scratch after every update
+    Returns false if either differs, as update_cell must leave the same structure as a full rebuild.
+*/
+bool benchmark_map_updates(const std::string name, const char* map, const size_t map_w, const size_t map_h, const size_t nupdates) {
+    std::string edited(map, map_w * map_h);
+    DistanceField field(edited.c_str(), map_w, map_h);
+    OccupancyHierarchy occupancy(edited.c_str(), map_w, map_h);
+    std::mt19937 rng(1);
+    size_t field_mismatches = 0, occupancy_mismatches = 0;
+    double update_time = 0, rebuild_time = 0;
+    for (size_t i = 0; i < nupdates; i++) {
+        const int x = int(rng() % map_w);
+        const int y = int(rng() % map_h);
+        char& cell = edited[x + y * map_w];
+        cell = cell == ' ' ? '0' : ' ';
+
+        auto start = std::chrono::steady_clock::now();
+        field.update_cell(edited.c_str(), x, y);
+        occupancy.update_cell(edited.c_str(), x, y);
+        auto updated = std::chrono::steady_clock::now();
+        const DistanceField rebuilt_field(edited.c_str(), map_w, map_h);
+        const OccupancyHierarchy rebuilt_occupancy(edited.c_str(), map_w, map_h);
+        auto rebuilt = std::chrono::steady_clock::now();
+        update_time += std::chrono::duration<double>(updated - start).count();
+        rebuild_time += std::chrono::duration<double>(rebuilt - updated).count();
+
+        if (!(field == rebuilt_field))field_mismatches++;
+        if (!(occupancy == rebuilt_occupancy))occupancy_mismatches++;
+    }
+
+    std::cout << std::setw(24) << std::left << name << std::right << std::fixed << std::setprecision(2)
+        << " update " << std::setw(8) << update_time / nupdates * 1e6 << " us"
+        << "  rebuild " << std::setw(8) << rebuild_time / nupdates * 1e6 << " us"
+        << "  field mismatches " << field_mismatches << "  hierarchy mismatches " << occupancy_mismatches << std::endl;
+    if (field_mismatches > 0 || occupancy_mismatches > 0) {
+        std::cerr << name << ": cell updates differ from a full rebuild" << std::endl;
         return false;
     }
+    return true;
+}
 
-    texture = std::vector<uint32_t>(w * h);
-    for (int j = 0; j < h; j++) {
-        for (int i = 0; i < w; i++) {
-            uint8_t r = pixmap[(i + j * w) * 4 + 0];
-            uint8_t g = pixmap[(i + j * w) * 4 + 1];
-            uint8_t b = pixmap[(i + j * w) * 4 + 2];
-            uint8_t a = pixmap[(i + j * w) * 4 + 3];
-            texture[i + j * w] = pack_color(r, g, b, a);
+/*
+    Encodes panning frames into a column delta file, checks that every frame decodes back exactly, and that
+    the decoder rejects the file with an unknown frame kind and with a frame cut short
+    The file is written to the working directory and removed afterwards.
+*/
+bool check_column_delta() {
+    const size_t w = 64, h = 32, frames = 8;
+    const std::string filename = "column_delta_check.rmc";
+    std::mt19937 rng(1);
+    std::vector<uint32_t> scene((w + frames) * h);
+    for (uint32_t& color : scene) color = rng() % 4 * 0x3f3f3f;
+    std::vector<uint8_t> file_bytes, bytes;
+    ColumnDeltaEncoder encoder(w, h, 3);
+    encoder.header(file_bytes);
+    for (size_t f = 0; f < frames; f++) {
+        encoder.encode_column_frame(scene.data() + f * h, bytes);//panning one column per frame
+        file_bytes.insert(file_bytes.end(), bytes.begin(), bytes.end());
+    }
+    {
+        std::fstream file(filename, std::fstream::in | std::fstream::out | std::fstream::binary | std::fstream::trunc);
+        file.write(reinterpret_cast<const char*>(file_bytes.data()), file_bytes.size());
+        if (!encoder.finish(file)) {
+            std::cerr << "column delta check: " << filename << " not written" << std::endl;
+            return false;
         }
     }
 
-    stbi_image_free(pixmap);
+    size_t mismatches = 0;
+    std::vector<uint32_t> image;
+    size_t image_w, image_h;
+    for (size_t f = 0; f < frames; f++) {
+        bool same = decode_column_delta(filename, f + 1, image, image_w, image_h) && image_w == w && image_h == h;
+        for (size_t x = 0; same && x < w; x++) {
+            for (size_t y = 0; y < h; y++) same &= image[x + y * w] == (scene[(x + f) * h + y] | 0xff000000);
+        }
+        if (!same)mismatches++;
+    }
+
+    //frame 2 is a delta; an unknown kind byte, then a run count past the end of its data
+    std::ifstream read_back(filename, std::ifstream::in | std::ifstream::binary | std::ifstream::ate);
+    std::vector<uint8_t> good(size_t(read_back.tellg()));
+    read_back.seekg(0);
+    read_back.read(reinterpret_cast<char*>(good.data()), good.size());
+    read_back.close();
+    const size_t index_offset = size_t(get_le(&good[24], 8));
+    const size_t second = size_t(get_le(&good[index_offset + 9], 8));
+    std::vector<uint8_t> bad_kind = good, cut_short = good;
+    bad_kind[second] = 7;
+    cut_short[second + 1] += 1;
+    size_t accepted = 0;
+    std::streambuf* errors = std::cerr.rdbuf();
+    std::ostringstream expected_errors;
+    std::cerr.rdbuf(expected_errors.rdbuf());
+    for (const std::vector<uint8_t>* corrupt : { &bad_kind, &cut_short }) {
+        if (write_file(filename, *corrupt) && decode_column_delta(filename, 2, image, image_w, image_h))accepted++;
+    }
+    std::cerr.rdbuf(errors);
+    std::remove(filename.c_str());
+
+    std::cout << "column delta check  frames " << frames << "  mismatches " << mismatches << "  corrupt files accepted " << accepted << std::endl;
+    if (mismatches > 0 || accepted > 0) {
+        std::cerr << "column delta check: decoded frames differ or a corrupt file was decoded" << std::endl;
+        return false;
+    }
     return true;
 }
 
 /*
-    unpacks 32-bit color representation into 4 8-bit color traits
+    Renders frames looking down a long corridor lined with large textures, with and without mipmaps,
+    and with mipmaps drawn through streaming stores, and reports frame time and texture memory fetched per frame
+    Fetched memory counts the distinct 64-byte lines each wall column reads from its texture column.
 */
-void unpack_color(const uint32_t& color, uint8_t &r, uint8_t &g, uint8_t &b, uint8_t &a) {
-    a = (color >> 24) & 255;
-    b = (color>>16) & 255;
-    g = (color>>8) & 255;
-    r = (color) & 255;
+void benchmark_mipmaps() {
+    const size_t win_w = 1024, win_h = 512;
+    const size_t map_w = 6, map_h = 512;
+    const size_t texsize = 256, ntextures = 32;
+
+    //corridor four cells wide, walls cycling through the atlas
+    std::string map(map_w * map_h, ' ');
+    for (size_t y = 0; y < map_h; y++) {
+        for (size_t x = 0; x < map_w; x++) {
+            if (x == 0 || x == map_w - 1 || y == 0 || y == map_h - 1) map[x + y * map_w] = '0' + (x + y) % ntextures;
+        }
+    }
+    std::mt19937 rng(1);
+    TextureAtlas atlas;
+    uint32_t* pixels = atlas.allocate(texsize, ntextures);
+    for (size_t i = 0; i < texsize * texsize * ntextures; i++) pixels[i] = rng() | 0xff000000;
+    atlas.build_mips();
+
+    CellGrid grid(map.c_str(), map_w, map_h);
+    const float fov = M_PI / 3;
+    const ColumnTable columns(win_w, fov);
+    const Camera camera(3.0f, 1.5f, M_PI / 2, fov);//looking down the corridor
+    choose_ray_caster(grid, map.c_str(), camera.x, camera.y, float(map_h));
+    FrameBuffer screen(win_w, win_h);
+    std::vector<float> ray_dir_x(win_w), ray_dir_y(win_w);
+    std::vector<RayHit> hits(win_w);
+
+    const char* names[] = { "without mipmaps", "with mipmaps   ", "streamed       " };
+    for (int run = 0; run < 3; run++) {
+        const ColumnFill fill = { pack_color(255, 255, 255), pack_color(255, 255, 255), run == 2 };
+        const RenderContext ctx = { map.c_str(), map_w, map_h, &grid, &atlas, &columns, win_w, win_h, float(map_h), nullptr, nullptr, nullptr, run > 0, 0.0f, fill };
+        size_t frames = 0;
+        auto start = std::chrono::steady_clock::now();
+        double elapsed = 0;
+        while (elapsed < 0.5) {
+            render_columns(ctx, camera, screen.data(), ray_dir_x.data(), ray_dir_y.data(), hits.data(), 0, win_w);
+            frames++;
+            elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        }
+
+        size_t lines = 0;
+        for (size_t i = 0; i < win_w; i++) {
+            if (!hits[i].hit)continue;
+            const uint64_t column_height = (uint64_t)std::min(win_h / (hits[i].dist * columns.fisheye[i]), 1e9f);
+            const size_t level = ctx.mipmaps ? atlas.mip_level(column_height) : 0;
+            const size_t level_size = texsize >> level;
+            const size_t visible = std::min<uint64_t>(column_height, win_h);
+            //rows read are spread evenly over the column, so the lines touched are bounded by both counts
+            lines += std::min(visible, (level_size * sizeof(uint32_t) + 63) / 64);
+        }
+        std::cout << "corridor " << names[run] << std::fixed << std::setprecision(3)
+            << " " << std::setw(7) << elapsed * 1000 / frames << " ms/frame  "
+            << std::setw(8) << std::setprecision(1) << lines * 64 / 1024.0 << " KiB texture fetched/frame" << std::endl;
+    }
 }
 
 /*
-    saves .ppm file which is a graphic representing a passed vector of colors
+    Times .ppm encoding of a 1024x512 frame: the old per-pixel stream insertion against the bulk RGB24 pack,
+    and from the renderer's column-major layout, reading columns with a row stride against the fused transpose and pack
 */
-void drop_ppm_image(const std::string filename, const std::vector<uint32_t> &image, const size_t w, const size_t h){
-    assert(image.size() == w*h);
+void benchmark_ppm_output() {
+    const size_t w = 1024, h = 512;
+    std::mt19937 rng(1);
+    std::vector<uint32_t> image(w * h), columns(w * h);
+    for (uint32_t& color : image) color = rng();
+    for (size_t x = 0; x < w; x++) {
+        for (size_t y = 0; y < h; y++) columns[x * h + y] = image[x + y * w];
+    }
 
-    std::ofstream ofs;
-    ofs.open(filename, std::ofstream::out | std::ofstream::binary);
-    ofs << "P6\n" << w << " " << h << "\n255\n";
-    for (int i = 0; i < w * h; i++) {
-        uint8_t r, g, b, a;
-        unpack_color(image[i], r, g, b, a);
-        ofs << static_cast<char>(r) << static_cast<char>(g) << static_cast<char>(b);
+    const char* names[] = { "per-pixel stream", "bulk rgb24      ", "columns strided ", "columns fused   " };
+    std::vector<uint8_t> encoded[4];
+    for (int method = 0; method < 4; method++) {
+        std::vector<uint8_t>& out = encoded[method];
+        size_t frames = 0;
+        auto start = std::chrono::steady_clock::now();
+        double elapsed = 0;
+        while (elapsed < 0.5) {
+            if (method == 0) {
+                std::ostringstream ss;
+                ss << "P6\n" << w << " " << h << "\n255\n";
+                for (size_t i = 0; i < w * h; i++) {
+                    uint8_t r, g, b, a;
+                    unpack_color(image[i], r, g, b, a);
+                    ss << static_cast<char>(r) << static_cast<char>(g) << static_cast<char>(b);
+                }
+                const std::string streamed = ss.str();
+                out.assign(streamed.begin(), streamed.end());
+            } else if (method == 1) {
+                encode_ppm(image.data(), w, h, out);
+            } else if (method == 2) {
+                std::stringstream header;
+                header << "P6\n" << w << " " << h << "\n255\n";
+                const std::string head = header.str();
+                out.resize(head.size() + w * h * 3);
+                std::memcpy(out.data(), head.data(), head.size());
+                uint8_t* rgb = out.data() + head.size();
+                for (size_t y = 0; y < h; y++) {
+                    for (size_t x = 0; x < w; x++, rgb += 3) {
+                        uint8_t a;
+                        unpack_color(columns[x * h + y], rgb[0], rgb[1], rgb[2], a);
+                    }
+                }
+            } else {
+                encode_ppm_columns(columns.data(), w, h, out);
+            }
+            frames++;
+            elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        }
+        std::cout << "ppm encode " << names[method] << std::fixed << std::setprecision(3)
+            << " " << std::setw(7) << elapsed * 1000 / frames << " ms/frame" << std::endl;
     }
-    ofs.close();
+    for (int method = 1; method < 4; method++) {
+        if (encoded[method] != encoded[0]) std::cerr << "ppm encoders disagree: " << names[method] << std::endl;
+    }
+}
+
+/*
+    Times every frame format on the player views of the default rotation sequence, every 10th frame
+    MB/s is of RGB24 pixel data, and ratio is that size over the encoded size. Encoders that split frames
+    use one thread per hardware thread. Needs walltext.png.
+*/
+void benchmark_frame_formats(const char* map, const size_t map_w, const size_t map_h, const float player_x, const float player_y, const float player_a) {
+    const size_t win_w = 1024, win_h = 512;
+    TextureAtlas atlas;
+    if (!load_texture("walltext.png", atlas)) {
+        std::cout << "frame formats skipped, walltext.png not found" << std::endl;
+        return;
+    }
+    CellGrid grid(map, map_w, map_h);
+    choose_ray_caster(grid, map, player_x, player_y, 20.0f);
+    const float fov = M_PI / 3;
+    const ColumnTable columns(win_w, fov);
+    Camera camera(player_x, player_y, player_a, fov);
+    const RenderContext ctx = { map, map_w, map_h, &grid, &atlas, &columns, win_w, win_h, 20.0f, nullptr, nullptr, nullptr, true, 0.0f,
+        { pack_color(255, 255, 255), pack_color(255, 255, 255), false } };
+    std::vector<float> ray_dir_x(win_w), ray_dir_y(win_w);
+    std::vector<RayHit> hits(win_w);
+    std::vector<std::vector<uint32_t>> frames;
+    for (int frame = 10; frame < 360; frame += 10) {
+        camera.set_angle(player_a + frame * 2 * M_PI / 360);
+        std::vector<uint32_t> screen(win_w * win_h);
+        render_columns(ctx, camera, screen.data(), ray_dir_x.data(), ray_dir_y.data(), hits.data(), 0, win_w);
+        std::vector<uint32_t> rows(win_w * win_h);
+        transpose_to_rows(screen.data(), win_w, win_h, 0, win_h, rows.data());
+        frames.push_back(std::move(rows));
+    }
+
+    const double raw_bytes = double(frames.size()) * win_w * win_h * 3;
+    std::vector<uint8_t> bytes;
+    std::vector<uint8_t> copy(win_w * win_h * 3);
+    ThreadPool pool(0);
+    //memcpy of the RGB24 frame size as the speed to aim for
+    for (size_t f = 0; f <= sizeof(FRAME_FORMATS) / sizeof(FRAME_FORMATS[0]); f++) {
+        const FrameFormat* format = f > 0 ? FRAME_FORMATS[f - 1] : nullptr;
+        size_t passes = 0, encoded = 0;
+        auto start = std::chrono::steady_clock::now();
+        double elapsed = 0;
+        while (elapsed < 0.5) {
+            encoded = 0;
+            for (const std::vector<uint32_t>& frame : frames) {
+                if (format) {
+                    format->encode(frame.data(), win_w, win_h, bytes, &pool);
+                    encoded += bytes.size();
+                } else {
+                    std::memcpy(copy.data(), frame.data(), copy.size());
+                    encoded += copy.size();
+                }
+            }
+            passes++;
+            elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        }
+        std::cout << "frames " << std::setw(6) << (format ? format->name : "memcpy") << std::fixed << std::setprecision(1)
+            << " " << std::setw(8) << raw_bytes * passes / elapsed / 1e6 << " MB/s  ratio "
+            << std::setprecision(2) << std::setw(6) << raw_bytes / encoded << std::endl;
+    }
+}
+
+/*
+    Times loading walltext.png by decoding it, and through a texture cache file written on the first cached load
+    and mapped on the ones after. The cache file is written to the working directory and removed afterwards.
+*/
+void benchmark_texture_cache() {
+    auto time_loads = [](const bool cached, const bool once) {
+        size_t loads = 0;
+        auto start = std::chrono::steady_clock::now();
+        double elapsed = 0;
+        while (elapsed < 0.5) {
+            TextureAtlas atlas;
+            if (!(cached ? load_texture_cached("walltext.png", ".", atlas) : load_texture("walltext.png", atlas)))return -1.0;
+            loads++;
+            elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            if (once)break;
+        }
+        return elapsed * 1000 / loads;
+    };
+    uint64_t key;
+    const std::string cache_name = texture_cache_file("walltext.png", ".", key);
+    if (cache_name.empty()) {
+        std::cout << "texture cache skipped, walltext.png not found" << std::endl;
+        return;
+    }
+    std::remove(cache_name.c_str());
+    const double decode = time_loads(false, false);
+    const double build = time_loads(true, true);
+    const double mapped = time_loads(true, false);
+    std::remove(cache_name.c_str());
+    std::cout << "texture load" << std::fixed << std::setprecision(3) << "  decode " << decode << " ms  decode and write cache "
+        << build << " ms  mapped cache " << mapped << " ms" << std::endl;
+}
+
+/*
+    Runs the ray caster benchmarks on the built-in map and on large synthetic maps
+    Returns false if a benchmark found results that differ where they must match.
+*/
+bool run_benchmarks(const char* map, const size_t map_w, const size_t map_h, const float player_x, const float player_y, const float player_a) {
+#ifndef RAYMANCER_AVX2
+    std::cout << "AVX2 not enabled in this build, packet caster falls back to scalar" << std::endl;
+#endif
+    bool passed = true;
+    benchmark_ray_casters("built-in 16x16", map, map_w, map_h, player_x, player_y, 4096);
+    const size_t sizes[] = { 256, 1024, 4096 };
+    for (size_t size : sizes) {
+        std::string synthetic = make_synthetic_map(size, 0.01f, 1);
+        std::stringstream name;
+        name << "synthetic " << size << "x" << size;
+        benchmark_ray_casters(name.str(), synthetic.c_str(), size, size, size / 2 + 0.5f, size / 2 + 0.5f, 4096);
+    }
+    const float wall_ratios[] = { 0.05f, 0.01f, 0.001f, 0.0001f };
+    for (size_t size : sizes) {
+        for (float ratio : wall_ratios) {
+            std::string synthetic = make_synthetic_map(size, ratio, 1);
+            std::stringstream name;
+            name << "hierarchy " << size << " " << std::setprecision(2) << std::fixed << ratio * 100 << "% walls";
+            passed &= benchmark_hierarchy(name.str(), synthetic.c_str(), size, size, size / 2 + 0.5f, size / 2 + 0.5f, 4096);
+        }
+    }
+    benchmark_mipmaps();
+    benchmark_ray_marcher("marcher built-in 16x16", map, map_w, map_h, player_x, player_y, 4096);
+    std::string open_map = make_synthetic_map(256, 0.01f, 1);
+    benchmark_ray_marcher("marcher synthetic 256", open_map.c_str(), 256, 256, 128.5f, 128.5f, 1024);
+    passed &= benchmark_map_updates("updates built-in 16x16", map, map_w, map_h, 4096);
+    passed &= benchmark_map_updates("updates synthetic 256", open_map.c_str(), 256, 256, 1024);
+    std::string sparse_map = make_synthetic_map(1024, 0.0001f, 1);
+    passed &= benchmark_map_updates("updates synthetic 1024", sparse_map.c_str(), 1024, 1024, 128);
+    benchmark_ppm_output();
+    benchmark_frame_formats(map, map_w, map_h, player_x, player_y, player_a);
+    benchmark_texture_cache();
+    passed &= check_column_delta();
+    return passed;
 }
 
-int main()
+int main(int argc, char** argv)
 {
     const size_t win_w = 1024;//image width
     const size_t win_h = 512;//image height
     std::vector<uint32_t> framebuffer(win_w*win_h, 255);
-    std::vector<uint32_t> screenBuffer(win_w * win_h, 255);
 
 
+#ifdef RAYMANCER_EMBEDDED_MAP
+    const size_t map_w = EMBEDDED_MAP_W;
+    const size_t map_h = EMBEDDED_MAP_H;
+    const char* map = EMBEDDED_MAP;
+#else
     const size_t map_w = 16;
     const size_t map_h = 16;
     const char map[] =  "0000222222220000"\
@@ -157,11 +4530,30 @@ int main()
                         "0              0"\
                         "0002222222200000"; // game map
     assert(sizeof(map) == map_w * map_h + 1);//+1 for null terminated string
+#endif
+    CellGrid grid(map, map_w, map_h);
 
     float player_x = 3.456f;
     float player_y = 2.345f;
     float player_a = 1.523f;
     float fov = M_PI/3;
+    Camera camera(player_x, player_y, player_a, fov);
+    const ColumnTable columns(win_w, fov);
+
+    Options opts;
+    if (!parse_options(argc, argv, opts)) return -1;
+    if (!opts.embed.empty()) {
+        return write_embedded_assets(opts.embed, opts.embed_map, opts.embed_out) ? 0 : -1;
+    }
+    if (!opts.decode.empty()) {
+        std::vector<uint32_t> image;
+        size_t w = 0, h = 0;
+        if (!decode_column_delta(opts.decode, opts.decode_frame, image, w, h)) return -1;
+        return drop_ppm_image(opts.decode_out, image, w, h) ? 0 : -1;
+    }
+    if (opts.bench) {
+        return run_benchmarks(map, map_w, map_h, player_x, player_y, player_a) ? 0 : -1;
+    }
 
     //---------------------SETUP COLORS---------------------
     size_t nColors = 10;
@@ -171,13 +4563,24 @@ int main()
     }
 
     //--------------------LOAD TEXTURES---------------------
-    std::vector<uint32_t> wallText;
-    size_t wallText_size;//texture dimensions (square)
-    size_t wallText_cnt;//number of different textures
-    if (!load_texture("walltext.png", wallText, wallText_size, wallText_cnt)) {
+    TextureAtlas wallText;
+#ifdef RAYMANCER_EMBEDDED_ASSETS
+    static_assert(EMBEDDED_LAYOUT_VERSION == TEXTURE_CACHE_VERSION && EMBEDDED_LIGHT_LEVELS == TextureAtlas::LIGHT_LEVELS,
+        "embedded_assets.h was generated for another atlas layout, run Raymancer embed again");
+    assert(sizeof(EMBEDDED_TEXTURE_BLOCK) == TextureAtlas::layout(EMBEDDED_TEXTURE_SIZE, EMBEDDED_TEXTURE_COUNT).bytes);
+    wallText.view(reinterpret_cast<const uint8_t*>(EMBEDDED_TEXTURE_BLOCK), EMBEDDED_TEXTURE_SIZE, EMBEDDED_TEXTURE_COUNT, EMBEDDED_PALETTE_SIZE, nullptr);
+    if (!opts.texture_cache.empty()) {
+        std::cerr << "Embedded assets build: --texture-cache is ignored." << std::endl;
+    }
+#else
+    //the palette is only drawn from by the shaded path
+    const bool palettize = opts.shade > 0;
+    const bool loaded = opts.texture_cache.empty() ? load_texture("walltext.png", wallText, palettize) : load_texture_cached("walltext.png", opts.texture_cache, wallText, palettize);
+    if (!loaded) {
         std::cerr << "Failed to load texture." << std::endl;
         return -1;
     }
+#endif
 
     //--------------------initialize map and player view arrays--------------------
     for (size_t j = 0; j < win_h; j++) {
@@ -186,7 +4589,6 @@ int main()
             uint8_t g = 255 * i / float(win_w);
             uint8_t b = 0;
             framebuffer[i + j * win_w] = pack_color(r, g, b);
-            screenBuffer[i + j * win_w] = pack_color(255,255,255);
         }
     }
 
@@ -201,9 +4603,9 @@ int main()
             size_t rect_y = j * rect_h;
 
             size_t texid = map[i+j*map_w]-'0';
-            assert(texid < wallText_cnt);
+            assert(texid < wallText.count);
 
-            draw_rectangle(framebuffer, win_w, win_h, rect_x, rect_y, rect_w, rect_h, wallText[texid*wallText_size]);//texid*wallText_size = id*width to get to the first pixel of the one you want
+            draw_rectangle(framebuffer, win_w, win_h, rect_x, rect_y, rect_w, rect_h, wallText.pixels[texid*wallText.size]);//texid*wallText.size = id*width to get to the first pixel of the one you want
         }
     }
 
@@ -211,70 +4613,153 @@ int main()
     draw_rectangle(framebuffer, win_w, win_h, player_x*rect_w, player_y*rect_h, 5,5, pack_color(255,255,255));
 
     //--------------------------RAYCAST FROM PLAYER VIEW-----------------------
-    for (int frame = 1; frame < 360; frame++) {
-        player_a += 2*M_PI/360;
-
-        screenBuffer = std::vector<uint32_t>(win_w * win_h, pack_color(255, 255, 255));        
-
-        std::stringstream ss;
-        ss << std::setfill('0') << std::setw(5) << frame << ".ppm";
-        //printing current output
-        std::cout << ss.str() << std::endl;
-
-        for (float i = 0; i < win_w; i++) {//do for window width so that you have a ray for every horizontal pixel after
-            float t = 0.0f;
-            float angle;
-            float cx, cy;
-            size_t pix_x, pix_y;
+    ThreadPool pool(opts.threads);
+    std::unique_ptr<PanoramaCache> panorama;
+    std::unique_ptr<DistanceField> march_field;
+    std::unique_ptr<OccupancyHierarchy> occupancy;
+#ifdef RAYMANCER_FIXED_POINT
+    //the fixed-point renderer casts every column itself, so none of them is built or kept up to date
+    if (opts.panorama > 0 || opts.march || opts.hierarchy) {
+        std::cerr << "Fixed-point build: --panorama, --march and --hierarchy are ignored." << std::endl;
+    }
+#else
+    if (opts.panorama > 0) panorama.reset(new PanoramaCache(opts.panorama));
+    if (opts.march) march_field.reset(new DistanceField(map, map_w, map_h));
+    if (opts.hierarchy) occupancy.reset(new OccupancyHierarchy(map, map_w, map_h));
+#endif
+    const float max_dist = 20.0f;
+    choose_ray_caster(grid, map, player_x, player_y, max_dist);
+    const RenderContext ctx = { map, map_w, map_h, &grid, &wallText, &columns, win_w, win_h, max_dist, panorama.get(), march_field.get(), occupancy.get(), opts.mipmaps, opts.shade,
+        { pack_color(255, 255, 255), pack_color(255, 255, 255), opts.stream_stores } };
+    //chunks are a multiple of the 8-ray packet width, a few per thread so uneven columns balance out
+    const size_t chunk = std::max<size_t>(8, (win_w / (pool.size() * 4) + 7) / 8 * 8);
+    std::vector<float> ray_dir_x(win_w), ray_dir_y(win_w);
+    std::vector<RayHit> hits(win_w);
+#ifdef RAYMANCER_FIXED_POINT
+    FixedCamera fixed_camera(to_fixed(player_x), to_fixed(player_y), to_fixed(player_a), to_fixed(fov));
+    const FixedColumnTable fixed_columns(win_w, to_fixed(fov));
+#endif
+    //with a Y4M stream the frames go to one file or stdout, and progress moves to stderr out of its way
+    std::ofstream y4m_file;
+    std::ostream* y4m_stream = nullptr;
+    if (opts.y4m == "-") {
+#ifdef _WIN32
+        _setmode(_fileno(stdout), _O_BINARY);
+#endif
+        y4m_stream = &std::cout;
+    } else if (!opts.y4m.empty()) {
+        y4m_file.open(opts.y4m, std::ofstream::out | std::ofstream::binary);
+        if (!y4m_file) {
+            std::cerr << "Unable to open file: " << opts.y4m << std::endl;
+            return -1;
+        }
+        y4m_stream = &y4m_file;
+    }
+    std::ostream& progress = y4m_stream == &std::cout ? std::cerr : std::cout;
+    if (y4m_stream) *y4m_stream << y4m_header(win_w, win_h, 30);
 
-            for (; t < 20.0f; t += 0.01f) {
-                angle = player_a - (fov / 2) + fov * (i / win_w);//start at player angle - half fov, then add 
-                cx = player_x + t * cos(angle);
-                cy = player_y + t * sin(angle);
-                if (map[(int)cx + (int)cy * map_w] != ' ')break;                
+    //a column delta sequence is one file too, with its header rewritten and index added once all frames are in
+    std::fstream delta_file;
+    std::unique_ptr<ColumnDeltaEncoder> delta;
+    if (!opts.delta.empty()) {
+        delta_file.open(opts.delta, std::fstream::in | std::fstream::out | std::fstream::binary | std::fstream::trunc);
+        if (!delta_file || y4m_stream) {
+            std::cerr << (y4m_stream ? "--delta and --y4m cannot be combined" : "Unable to open file: " + opts.delta) << std::endl;
+            return -1;
+        }
+        delta.reset(new ColumnDeltaEncoder(win_w, win_h, opts.keyframes));
+        std::vector<uint8_t> header;
+        delta->header(header);
+        delta_file.write(reinterpret_cast<const char*>(header.data()), header.size());
+    }
+    std::ostream* frame_stream = delta ? &delta_file : y4m_stream;
 
-                pix_x = cx * rect_w;
-                pix_y = cy * rect_h;
-                framebuffer[pix_x + pix_y * win_w] = pack_color(255, 255, 255);//Drawing visual rays
-            }
+    ThreadPool encode_pool(opts.encode_threads);
+    FrameOutput output;
+    output.format = y4m_stream ? &Y4M_FRAMES : opts.format;
+    output.stream = frame_stream;
+    output.sync_writes = opts.fsync;
+    output.encode_pool = &encode_pool;
+    output.delta = delta.get();
+    output.io_uring = opts.io_uring;
+    FramePipeline pipeline(win_w, win_h, 2, output, opts.huge_pages);
+    if (opts.huge_pages && !pipeline.on_huge_pages()) {
+        std::cerr << "Huge pages unavailable, frame buffers use normal pages" << std::endl;
+    }
+#ifdef RAYMANCER_COUNT_ALLOCATIONS
+    size_t allocating_frames = 0;
+#endif
+    for (int frame = 1; frame < 360; frame++) {
+#ifdef RAYMANCER_COUNT_ALLOCATIONS
+        const size_t allocations = heap_allocations();
+#endif
+        player_a += 2*M_PI/360;
+        camera.set_angle(player_a);
+        if (panorama && !panorama->valid_for(camera.x, camera.y)) {
+            panorama->build(map, grid, camera.x, camera.y, ctx.max_dist, pool);
+        }
 
-            //-----------------FIND TEXTURE TEXTURE COORDINATE POSITION-----------------------
-            float hitx = cx - floor(cx + 0.5);//subtract the nearest whole to get the distance to the nearest whole
-            float hity = cy - floor(cy + 0.5);
-            int x_texcoord;
-            if(std::abs(hitx)>std::abs(hity)){//compare absolute values to see which one is further from a whole. this is the axis which the face is on.
-                x_texcoord = hitx * wallText_size;
-            }else{
-                x_texcoord = hity * wallText_size;
-            }
-            //position may be negative, and must be made positive to reference texture position
-            if (x_texcoord < 0) x_texcoord += wallText_size;
-            assert(x_texcoord>=0 && x_texcoord<(int)wallText_size);
+        //printing current output, formatted in place as frame_filename would build it, so printing does not allocate
+        if (frame_stream) progress << "frame " << frame << std::endl;
+        else progress << std::setfill('0') << std::setw(5) << frame << std::setfill(' ') << opts.format->extension << std::endl;
 
-            //get texture id from current wall collision
-            size_t texid = map[(int)cx + (int)cy * map_w] - '0';
-            assert(texid < wallText_cnt);
+        //every column is drawn top to bottom, so the frame is not cleared first
+        FrameBuffer& screenBuffer = pipeline.acquire_frame();
 
-            size_t column_height = win_h / (t * cos(angle - player_a));
+#ifdef RAYMANCER_FIXED_POINT
+        fixed_camera.set_angle(to_fixed(player_a));
+        auto render_chunk = [&](size_t begin, size_t end) {
+            render_columns_fixed(ctx, fixed_camera, fixed_columns, screenBuffer.data(), ray_dir_x.data(), ray_dir_y.data(), hits.data(), begin, end);
+        };
+#else
+        auto render_chunk = [&](size_t begin, size_t end) {
+            render_columns(ctx, camera, screenBuffer.data(), ray_dir_x.data(), ray_dir_y.data(), hits.data(), begin, end);
+        };
+#endif
+        pool.parallel_for(win_w, chunk, render_chunk);
 
-            std::vector<uint32_t> column = texture_column(wallText, wallText_size, wallText_cnt, texid, x_texcoord, column_height);
+        draw_map_rays(framebuffer, win_w, win_h, camera, ray_dir_x.data(), ray_dir_y.data(), hits.data(), win_w, rect_w, rect_h);
 
-            pix_x = i;
-            for (size_t j = 0; j < column_height; j++) {
-                pix_y = j + win_h / 2 - column_height / 2;
-                if (pix_y < 0 || pix_y >= (int)win_w)continue;
-                screenBuffer[pix_x + pix_y * win_w] = column[j];
-            }
+        //hand the player view to the encoder and writer threads
+        pipeline.submit_frame(frame, screenBuffer);
+#ifdef RAYMANCER_COUNT_ALLOCATIONS
+        //nothing in a frame of the render loop may allocate once running, progress printing included
+        if (frame > 1 && heap_allocations() != allocations) allocating_frames++;
+        assert(frame == 1 || heap_allocations() == allocations);
+#endif
+    }
+    pipeline.finish();
+    if (pipeline.stalls() > 0) {
+        progress << pipeline.stalls() << " frames waited for the encoder or writer" << std::endl;
+    }
+    if (opts.io_uring) pipeline.report_writes(progress);
+#ifdef RAYMANCER_COUNT_ALLOCATIONS
+    progress << allocating_frames << " frames allocated on the render thread after the first" << std::endl;
+#endif
+    if (delta) {
+        if (!delta->finish(delta_file)) {
+            std::cerr << "Unable to write column delta file: " << opts.delta << std::endl;
+            return -1;
+        }
+        delta_file.close();
+        if (opts.fsync) sync_file(opts.delta);
+    }
+    if (y4m_stream) {
+        y4m_stream->flush();
+        if (!*y4m_stream) {
+            std::cerr << "Unable to write video: " << opts.y4m << std::endl;
+            return -1;
+        }
+        if (y4m_stream == &y4m_file) {
+            y4m_file.close();
+            if (opts.fsync) sync_file(opts.y4m);
         }
-
-        //create player view file
-        drop_ppm_image(ss.str(), screenBuffer, win_w, win_h);
     }
 
     const size_t texid = 4;
-    for (size_t i = 0; i < wallText_size; i++) {
-        for (size_t j = 0; j < wallText_size; j++) {
-            framebuffer[i + j * win_w] = wallText[i + texid * wallText_size + j * wallText_size * wallText_cnt];
+    for (size_t i = 0; i < wallText.size; i++) {
+        for (size_t j = 0; j < wallText.size; j++) {
+            framebuffer[i + j * win_w] = wallText.pixels[i + texid * wallText.size + j * wallText.size * wallText.count];
         }
     }
 